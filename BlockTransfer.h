@@ -0,0 +1,437 @@
+#ifndef BlockTransfer_H
+#define BlockTransfer_H
+
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include <CANBus.h>
+#include "Settings.h"
+#include "BusScheduler.h"
+
+/*
+*  Binary block transfer of the settings, see commands 0x06 in SerialCommand.h
+*
+*  Packets, the same both ways:
+*  0x15 SEQ N D0..D(N-1) CRCH CRCL   Block SEQ, at OFFSET + SEQ * TRANSFER_BLOCK
+*  0x16 SEQ                          Ack, every block before SEQ was received
+*  0x17 STATUS                       End of transfer (device only), see TRANSFER_OK..
+*  0x18                              Abort (host only)
+*
+*  CRC is CRC-16/XMODEM of SEQ, N and the data. Blocks are N = TRANSFER_BLOCK bytes
+*  but the last. The sender keeps up to WINDOW blocks unacked and goes back to the
+*  first unacked one when acks stop for TRANSFER_TIMEOUT ms. A bad or out of order
+*  block is dropped and the current ack repeated.
+*
+*  Reads come from EEPROM, one block per tick when the port has room.
+*  Writes are staged: a good block waits in RAM until it's copied to the scratch half
+*  of the EEPROM and is acked then, so a host should keep at most TRANSFER_STAGE
+*  blocks unacked. Once the last one is staged they're loaded into cbt_settings, the
+*  busses whose config changed and the rules are set up again, and the range is saved
+*  to the settings. An aborted or timed out write leaves the settings untouched.
+*  EEPROM is written a byte at a time while it is ready, so no tick waits for it.
+*  0x17 is sent once everything is saved.
+*  While the range is saved its offset and length are marked in the settings. If the
+*  board resets before the mark is cleared, recover() saves the range again from the
+*  scratch area at the next boot. The mark itself can't be written by a transfer.
+*  The port carries only these packets until the transfer ends.
+*/
+
+#define TRANSFER_DATA 0x15
+#define TRANSFER_ACK 0x16
+#define TRANSFER_END 0x17
+#define TRANSFER_ABORT 0x18
+#define TRANSFER_BLOCK 16
+#define TRANSFER_PACKET (TRANSFER_BLOCK + 5)
+#define TRANSFER_WINDOW 4       // Default blocks in flight
+#define TRANSFER_WINDOW_MAX 8
+#define TRANSFER_TIMEOUT 500    // ms
+#define TRANSFER_RETRIES 4
+#define TRANSFER_STAGE 4        // Blocks received but not staged yet
+#define TRANSFER_SCRATCH 512    // EEPROM 512-1023, the settings use 0-511
+
+// End status
+#define TRANSFER_OK 0x00
+#define TRANSFER_TIMED_OUT 0x01
+#define TRANSFER_INCOMPLETE 0x02
+
+#define TRANSFER_MARK offsetof(struct cbt_settings, transferOffset)
+#define TRANSFER_MARK_SIZE (2 * sizeof(unsigned int))
+
+// Commit steps
+#define COMMIT_MARK 0
+#define COMMIT_RANGE 1
+#define COMMIT_UNMARK 2
+#define COMMIT_DONE 3
+
+#define TRANSFER_IDLE 0
+#define TRANSFER_READ 1
+#define TRANSFER_RECEIVE 2
+#define TRANSFER_COMMIT 3
+
+class BlockTransfer
+{
+  public:
+    BlockTransfer();
+    bool active() { return _state != TRANSFER_IDLE; }
+    bool owns(Stream* serial) { return _state != TRANSFER_IDLE && _serial == serial; }
+    Stream* serial() { return _serial; }
+    bool beginRead(Stream* serial, unsigned int offset, unsigned int length, byte window);
+    bool beginWrite(Stream* serial, unsigned int offset, unsigned int length);
+    void cancel();
+    void feed(byte c);
+    int tick(int room);
+    static void recover();
+
+  private:
+    Stream* _serial;
+    byte _state;
+    unsigned int _offset;
+    unsigned int _length;
+    byte _window;
+    byte _blocks;
+    byte _base;           // First unacked block when reading, next expected when writing
+    byte _next;           // Next block to send
+    byte _received;       // Next block expected when writing, _base is the next to stage
+    byte _retries;
+    bool _ackDue;
+    unsigned int _staged; // Bytes copied to the scratch area
+    unsigned int _commit; // Next settings byte to save
+    unsigned int _commitEnd;
+    byte _commitStep;
+    unsigned long _lastMs;  // Last progress
+    unsigned long _rxMs;    // Start of the packet in _rx
+    byte _rx[TRANSFER_PACKET];
+    byte _rxLength;
+    byte _stage[TRANSFER_STAGE][TRANSFER_BLOCK];
+
+    bool begin(Stream* serial, unsigned int offset, unsigned int length);
+    byte blockLength(byte seq);
+    int sendBlock(byte seq);
+    int finish(byte status);
+    void received();
+    void acked(byte seq);
+    bool saveByte(unsigned int address, byte value);
+    void stageSlice();
+    int apply();
+    void commitSlice();
+    void commitStep(byte step);
+};
+
+
+BlockTransfer::BlockTransfer() : _serial(0), _state(TRANSFER_IDLE), _rxLength(0)
+{
+}
+
+
+bool BlockTransfer::begin(Stream* serial, unsigned int offset, unsigned int length)
+{
+    if (active() || length == 0 || offset >= sizeof(cbt_settings) || length > sizeof(cbt_settings) - offset)
+        return false;
+
+    _serial = serial;
+    _offset = offset;
+    _length = length;
+    _blocks = (length + TRANSFER_BLOCK - 1) / TRANSFER_BLOCK;
+    _base = _next = _retries = 0;
+    _ackDue = false;
+    _rxLength = 0;
+    _lastMs = millis();
+    return true;
+}
+
+
+bool BlockTransfer::beginRead(Stream* serial, unsigned int offset, unsigned int length, byte window)
+{
+    if (window > TRANSFER_WINDOW_MAX || !begin(serial, offset, length)) return false;
+    _window = (window == 0)? TRANSFER_WINDOW : window;
+    _state = TRANSFER_READ;
+    return true;
+}
+
+
+bool BlockTransfer::beginWrite(Stream* serial, unsigned int offset, unsigned int length)
+{
+    if (!begin(serial, offset, length)) return false;
+    _state = TRANSFER_RECEIVE;
+    _received = 0;
+    _staged = 0;
+    _ackDue = true;  // Ready for block 0
+    return true;
+}
+
+
+// Stop without an end packet, staged blocks are dropped and loaded ones saved at once
+void BlockTransfer::cancel()
+{
+    if (_state == TRANSFER_COMMIT) {
+        cbt_settings.transferLength = 0;
+        Settings::save(&cbt_settings);
+    }
+    _state = TRANSFER_IDLE;
+}
+
+
+/*
+*  Finish a save that a reset cut short, before the settings are loaded at boot.
+*  The scratch area still holds the whole received range.
+*/
+void BlockTransfer::recover()
+{
+    unsigned int mark[2];  // Offset, length
+    eeprom_read_block(mark, (void*)TRANSFER_MARK, sizeof(mark));
+    if (mark[1] == 0 || mark[0] >= sizeof(cbt_settings) || mark[1] > sizeof(cbt_settings) - mark[0])
+        return;
+
+    byte chunk[SETTINGS_CHUNK];
+    unsigned int end = mark[0] + mark[1];
+    if (end > TRANSFER_MARK) end = TRANSFER_MARK;
+    for (unsigned int i = mark[0]; i < end; i += SETTINGS_CHUNK) {
+        byte n = (end - i > SETTINGS_CHUNK)? SETTINGS_CHUNK : end - i;
+        eeprom_read_block(chunk, (void*)(TRANSFER_SCRATCH + i), n);
+        eeprom_update_block(chunk, (void*)i, n);
+        LoopWatchdog::pet();
+    }
+    mark[0] = mark[1] = 0;
+    eeprom_update_block(mark, (void*)TRANSFER_MARK, sizeof(mark));
+}
+
+
+byte BlockTransfer::blockLength(byte seq)
+{
+    unsigned int left = _length - seq * TRANSFER_BLOCK;
+    return (left > TRANSFER_BLOCK)? TRANSFER_BLOCK : left;
+}
+
+
+void BlockTransfer::feed(byte c)
+{
+    if (_rxLength == 0) {
+        if (c == TRANSFER_ABORT && _state != TRANSFER_COMMIT) {
+            cancel();
+            return;
+        }
+        if (c != TRANSFER_DATA && c != TRANSFER_ACK) return;  // Resync on the next packet
+        _rxMs = millis();
+    }
+    _rx[_rxLength++] = c;
+    if (_rx[0] == TRANSFER_ACK) {
+        if (_rxLength == 2) {
+            if (_state == TRANSFER_READ) acked(_rx[1]);
+            _rxLength = 0;
+        }
+    } else if (_rxLength >= 3) {
+        if (_rx[2] > TRANSFER_BLOCK) {
+            _rxLength = 0;
+            _ackDue = true;
+        } else if (_rxLength == _rx[2] + 5) {
+            if (_state == TRANSFER_RECEIVE) received();
+            _rxLength = 0;
+        }
+    }
+}
+
+
+void BlockTransfer::received()
+{
+    byte seq = _rx[1];
+    byte length = _rx[2];
+    unsigned int crc = 0;
+    for (byte i = 1; i < length + 3; i++) crc = _crc_xmodem_update(crc, _rx[i]);
+
+    if (seq >= _blocks || seq != _received || _received - _base >= TRANSFER_STAGE || length != blockLength(seq) ||
+        crc != (((unsigned int)_rx[length + 3] << 8) | _rx[length + 4])) {
+        _ackDue = true;
+        return;
+    }
+
+    memcpy(_stage[seq % TRANSFER_STAGE], _rx + 3, length);
+    _received++;
+    _lastMs = millis();
+}
+
+
+void BlockTransfer::acked(byte seq)
+{
+    if (seq <= _base || seq > _blocks) return;
+    _base = seq;
+    if (_next < seq) _next = seq;  // Acks of blocks sent before going back
+    _retries = 0;
+    _lastMs = millis();
+}
+
+
+int BlockTransfer::sendBlock(byte seq)
+{
+    byte packet[TRANSFER_PACKET];
+    byte length = blockLength(seq);
+    unsigned int crc = 0;
+
+    packet[0] = TRANSFER_DATA;
+    packet[1] = seq;
+    packet[2] = length;
+    eeprom_read_block(packet + 3, (void*)(_offset + seq * TRANSFER_BLOCK), length);
+    for (byte i = 1; i < length + 3; i++) crc = _crc_xmodem_update(crc, packet[i]);
+    packet[length + 3] = crc >> 8;
+    packet[length + 4] = crc;
+    _serial->write(packet, length + 5);
+    return length + 5;
+}
+
+
+int BlockTransfer::finish(byte status)
+{
+    byte packet[2] = { TRANSFER_END, status };
+    _serial->write(packet, 2);
+    _state = TRANSFER_IDLE;
+    return 2;
+}
+
+
+// Write value unless EEPROM already holds it, true if written. EEPROM must be ready.
+bool BlockTransfer::saveByte(unsigned int address, byte value)
+{
+    if (eeprom_read_byte((uint8_t*)address) == value) return false;
+    eeprom_write_byte((uint8_t*)address, value);
+    return true;
+}
+
+
+/*
+*  Copy received blocks to the scratch area, one EEPROM write per call. Each block
+*  is acked once it's there, which frees its RAM slot.
+*/
+void BlockTransfer::stageSlice()
+{
+    unsigned int end = (unsigned int)_received * TRANSFER_BLOCK;
+    if (end > _length) end = _length;
+    while (_staged < end && eeprom_is_ready()) {
+        byte value = _stage[(_staged / TRANSFER_BLOCK) % TRANSFER_STAGE][_staged % TRANSFER_BLOCK];
+        bool written = saveByte(TRANSFER_SCRATCH + _offset + _staged, value);
+        if (++_staged % TRANSFER_BLOCK == 0 || _staged == _length) {
+            _base++;
+            _ackDue = true;
+            _lastMs = millis();
+        }
+        if (written) return;
+    }
+}
+
+
+/*
+*  Every block staged: load them into the settings and set up what depends on them
+*/
+int BlockTransfer::apply()
+{
+    if (_received != _blocks || _staged != _length) return finish(TRANSFER_INCOMPLETE);
+
+    struct busConfig busCfg[3];
+    unsigned int mark[2] = { cbt_settings.transferOffset, cbt_settings.transferLength };
+    memcpy(busCfg, cbt_settings.busCfg, sizeof(busCfg));
+    eeprom_read_block((byte*)&cbt_settings + _offset, (void*)(TRANSFER_SCRATCH + _offset), _length);
+    cbt_settings.transferOffset = mark[0];
+    cbt_settings.transferLength = mark[1];
+
+    for (byte b = 0; b < 3; b++) {
+        if (memcmp(&busCfg[b], &cbt_settings.busCfg[b], sizeof(busCfg[b])) == 0) continue;
+        busses[b].setMode(CONFIGURATION);
+        busses[b].baudConfig(cbt_settings.busCfg[b].baud);
+        busses[b].setMode(cbt_settings.busCfg[b].mode);
+        busScheduler.setMode(b, cbt_settings.busCfg[b].mode);
+    }
+    Settings::replaced();
+    _state = TRANSFER_COMMIT;
+    commitStep(COMMIT_MARK);
+    return 0;
+}
+
+
+/*
+*  The range is saved between setting and clearing the mark, see recover()
+*/
+void BlockTransfer::commitStep(byte step)
+{
+    _commitStep = step;
+    _commit = TRANSFER_MARK;
+    _commitEnd = TRANSFER_MARK + TRANSFER_MARK_SIZE;
+    if (step == COMMIT_MARK) {
+        cbt_settings.transferOffset = _offset;
+        cbt_settings.transferLength = _length;
+    } else if (step == COMMIT_RANGE) {
+        // The mark is saved by its own steps, apply() kept the host's bytes for it out
+        _commitEnd = _offset + _length;
+        if (_commitEnd > TRANSFER_MARK) _commitEnd = TRANSFER_MARK;
+        _commit = (_offset < _commitEnd)? _offset : _commitEnd;
+    } else if (step == COMMIT_UNMARK) {
+        cbt_settings.transferOffset = 0;
+        cbt_settings.transferLength = 0;
+    }
+}
+
+
+/*
+*  Save at most a block of changed bytes, one EEPROM write per call
+*/
+void BlockTransfer::commitSlice()
+{
+    const byte* settings = (const byte*)&cbt_settings;
+    for (byte n = 0; n < TRANSFER_BLOCK && _commitStep != COMMIT_DONE; n++) {
+        if (_commit == _commitEnd) {
+            commitStep(_commitStep + 1);
+            continue;
+        }
+        if (!eeprom_is_ready()) return;
+        bool written = saveByte(_commit, settings[_commit]);
+        _commit++;
+        if (written) return;
+    }
+}
+
+
+/*
+*  Send what fits in room bytes, returns the bytes sent
+*/
+int BlockTransfer::tick(int room)
+{
+    unsigned long now = millis();
+    int sent = 0;
+
+    switch (_state) {
+        case TRANSFER_READ:
+            if (_base == _blocks) return finish(TRANSFER_OK);
+            if (now - _lastMs >= TRANSFER_TIMEOUT) {
+                if (++_retries > TRANSFER_RETRIES) return finish(TRANSFER_TIMED_OUT);
+                _next = _base;  // Go back N
+                _rxLength = 0;
+                _lastMs = now;
+            }
+            if (_next < _blocks && _next - _base < _window && room >= blockLength(_next) + 5)
+                sent = sendBlock(_next++);
+            break;
+
+        case TRANSFER_RECEIVE:
+        case TRANSFER_COMMIT:
+            if (_ackDue && room >= 2) {
+                byte packet[2] = { TRANSFER_ACK, _base };
+                _serial->write(packet, 2);
+                _ackDue = false;
+                sent = 2;
+            }
+            if (_state == TRANSFER_RECEIVE) {
+                stageSlice();
+                if (_base == _blocks) sent += apply();
+                if (!active()) break;
+            }
+            if (_state == TRANSFER_COMMIT) {
+                commitSlice();
+                if (_commitStep == COMMIT_DONE && !_ackDue) sent += finish(TRANSFER_OK);
+            } else if (now - _lastMs >= (unsigned long)TRANSFER_TIMEOUT * TRANSFER_RETRIES) {
+                cancel();
+                sent += finish(TRANSFER_TIMED_OUT);
+            } else if (_rxLength > 0 && now - _rxMs >= TRANSFER_TIMEOUT) {
+                _rxLength = 0;  // Partial packet, the host will resend it
+            }
+            break;
+    }
+    return sent;
+}
+
+#endif // BlockTransfer_H
@@ -0,0 +1,233 @@
+#ifndef BusAnalyzer_H
+#define BusAnalyzer_H
+
+#include <MessageQueue.h>
+#include "Middleware.h"
+#include "Settings.h"
+#include "Frame.h"
+
+/*
+// Bus analyzer commands
+------------------------
+0xA3 0x01      Print per bus load and the top ANALYZER_TOP message ids by rate
+0xA3 0x02      Reset statistics
+
+Only frames that pass the hardware filters set in setup() are seen. Open the
+filters with 0x03 BUS 0x02 0x000 0x000 to measure the whole bus.
+Inter-arrival gaps use the time a frame was read from the controller, not the
+time it reaches the pipeline after waiting in the read queue.
+*/
+
+#define ANALYZER_SLOTS 16   // Must be a power of 2, 15 bytes each
+#define ANALYZER_TOP 8
+#define ANALYZER_WINDOW 1000 // ms
+#define ANALYZER_GAP_SHIFT FRAME_STAMP_SHIFT // Inter-arrival times are kept in 64 us units
+
+struct id_stats {
+    unsigned int key;       // bits 0-10: frame id, bits 11-12: bus id, 0 = empty slot
+    unsigned int count;     // Frames in the current window
+    unsigned int rate;      // Frames in the last window
+    unsigned long last;     // micros() of the last frame
+    unsigned int minGap;
+    unsigned int maxGap;
+    byte rateChanges;       // Windows where the rate moved more than 25%
+};
+
+struct bus_stats {
+    unsigned int count;     // Frames in the current window
+    unsigned long bits;     // Bits in the current window
+    unsigned int fps;
+    unsigned int peakFps;
+    unsigned int load;      // Per mille of the bus bit rate
+    unsigned int peakLoad;
+    unsigned long frames;
+};
+
+// Bits on the wire for a standard data frame by DLC: 47 + 8 * DLC plus stuff bits,
+// estimated as half of the worst case (34 + 8 * DLC - 1) / 4
+const byte frameBits[9] = { 51, 60, 69, 78, 87, 96, 105, 114, 123 };
+
+class BusAnalyzer : public Middleware
+{
+public:
+    BusAnalyzer();
+    void tick();
+    Message process(Message msg);
+    void arrived(unsigned int stamp);
+    void commandHandler(byte* bytes, int length, Stream* activeSerial);
+    void reset();
+
+private:
+    struct id_stats _ids[ANALYZER_SLOTS];
+    struct bus_stats _busses[3];
+    unsigned long _windowStart;
+    unsigned long _arrival;   // micros() when the frame being processed was read
+    unsigned int _collisions;
+
+    void closeWindow(unsigned long elapsed);
+    void report(Stream* serial);
+};
+
+BusAnalyzer::BusAnalyzer()
+{
+    reset();
+}
+
+void BusAnalyzer::reset()
+{
+    memset(_ids, 0, sizeof(_ids));
+    memset(_busses, 0, sizeof(_busses));
+    _collisions = 0;
+    _windowStart = millis();
+    _arrival = micros();
+}
+
+Message BusAnalyzer::process(Message msg)
+{
+    if (msg.busId < 1 || msg.busId > 3) return msg;
+
+    struct bus_stats *b = &_busses[msg.busId - 1];
+    b->count++;
+    b->bits += frameBits[(msg.length > 8)? 8 : msg.length];
+
+    // Direct mapped slot, a colliding id only takes over a slot that was idle for a whole window
+    unsigned int key = (msg.frame_id & 0x7FF) | ((unsigned int)msg.busId << 11);
+    struct id_stats *s = &_ids[(msg.frame_id ^ (msg.frame_id >> 4) ^ (msg.busId << 2)) & (ANALYZER_SLOTS - 1)];
+    unsigned long now = _arrival;
+
+    if (s->key != key) {
+        if (s->key != 0 && (s->count > 0 || s->rate > 0)) {
+            _collisions++;
+            return msg;
+        }
+        memset(s, 0, sizeof(struct id_stats));
+        s->key = key;
+        s->minGap = 0xFFFF;
+    }
+    else {
+        unsigned long gap = (now - s->last) >> ANALYZER_GAP_SHIFT;
+        if (gap > 0xFFFF) gap = 0xFFFF;
+        if (gap < s->minGap) s->minGap = gap;
+        if (gap > s->maxGap) s->maxGap = gap;
+    }
+    s->last = now;
+    s->count++;
+    return msg;
+}
+
+// Stamp of the next frame to process, see Frame::stamp. It waited less than 4 s in the queue.
+void BusAnalyzer::arrived(unsigned int stamp)
+{
+    unsigned long now = micros();
+    unsigned int age = (unsigned int)(now >> FRAME_STAMP_SHIFT) - stamp;
+    _arrival = now - ((unsigned long)age << FRAME_STAMP_SHIFT);
+}
+
+void BusAnalyzer::tick()
+{
+    unsigned long elapsed = millis() - _windowStart;
+    if (elapsed < ANALYZER_WINDOW) return;
+    closeWindow(elapsed);
+    _windowStart += elapsed;
+}
+
+void BusAnalyzer::closeWindow(unsigned long elapsed)
+{
+    for (byte i = 0; i < 3; i++) {
+        struct bus_stats *b = &_busses[i];
+        b->fps = (unsigned long)b->count * 1000L / elapsed;
+        // Bus capacity in the window is baud (kbit/s) * elapsed (ms) bits
+        unsigned long capacity = (unsigned long)cbt_settings.busCfg[i].baud * elapsed;
+        b->load = (capacity > 0)? b->bits * 1000L / capacity : 0;
+        if (b->fps > b->peakFps) b->peakFps = b->fps;
+        if (b->load > b->peakLoad) b->peakLoad = b->load;
+        b->frames += b->count;
+        b->count = 0;
+        b->bits = 0;
+    }
+
+    for (byte i = 0; i < ANALYZER_SLOTS; i++) {
+        struct id_stats *s = &_ids[i];
+        if (s->key == 0) continue;
+        unsigned int rate = (unsigned long)s->count * 1000L / elapsed;
+        unsigned int delta = (rate > s->rate)? rate - s->rate : s->rate - rate;
+        if (s->rate > 0 && delta > (s->rate >> 2) && s->rateChanges < 0xFF) s->rateChanges++;
+        s->rate = rate;
+        s->count = 0;
+    }
+}
+
+void BusAnalyzer::commandHandler(byte* bytes, int length, Stream* activeSerial)
+{
+    if (length == 0) {
+        activeSerial->write(COMMAND_ERROR);
+        return;
+    }
+
+    switch(bytes[0]) {
+        case 0x01:
+            report(activeSerial);
+            break;
+        case 0x02:
+            reset();
+            activeSerial->write(COMMAND_OK);
+            activeSerial->write(NEWLINE);
+            break;
+        default:
+            activeSerial->write(COMMAND_ERROR);
+    }
+}
+
+void BusAnalyzer::report(Stream* serial)
+{
+    for (byte i = 0; i < 3; i++) {
+        struct bus_stats *b = &_busses[i];
+        serial->print( F("{\"event\":\"busload\", \"bus\":") );
+        serial->print(i + 1);
+        serial->print( F(", \"fps\":") );
+        serial->print(b->fps);
+        serial->print( F(", \"peakFps\":") );
+        serial->print(b->peakFps);
+        serial->print( F(", \"load\":") );
+        serial->print(b->load);
+        serial->print( F(", \"peakLoad\":") );
+        serial->print(b->peakLoad);
+        serial->print( F(", \"frames\":") );
+        serial->print(b->frames);
+        serial->println( F("}") );
+    }
+
+    // Selection of the top ids by rate, only done on request
+    byte printed[ANALYZER_SLOTS];
+    memset(printed, 0, ANALYZER_SLOTS);
+    for (byte n = 0; n < ANALYZER_TOP; n++) {
+        int best = -1;
+        for (byte i = 0; i < ANALYZER_SLOTS; i++) {
+            if (_ids[i].key == 0 || printed[i]) continue;
+            if (best < 0 || _ids[i].rate > _ids[best].rate) best = i;
+        }
+        if (best < 0) break;
+        printed[best] = 1;
+
+        struct id_stats *s = &_ids[best];
+        serial->print( F("{\"event\":\"idrate\", \"bus\":") );
+        serial->print(s->key >> 11);
+        serial->print( F(", \"id\":\"") );
+        serial->print(s->key & 0x7FF, HEX);
+        serial->print( F("\", \"rate\":") );
+        serial->print(s->rate);
+        serial->print( F(", \"minGap\":") );
+        serial->print((s->minGap == 0xFFFF)? 0L : (long)s->minGap << ANALYZER_GAP_SHIFT);
+        serial->print( F(", \"maxGap\":") );
+        serial->print((long)s->maxGap << ANALYZER_GAP_SHIFT);
+        serial->print( F(", \"rateChanges\":") );
+        serial->print(s->rateChanges);
+        serial->println( F("}") );
+    }
+
+    serial->print( F("{\"event\":\"analyzer\", \"collisions\":") );
+    serial->print(_collisions);
+    serial->println( F("}") );
+}
+
+#endif // BusAnalyzer_H
@@ -0,0 +1,182 @@
+#ifndef BusScheduler_H
+#define BusScheduler_H
+
+#include "Settings.h"
+
+/*
+*  Receive arbitration between busses
+*
+*  Each loop the busses are polled round robin, each one reading at most its share
+*  of frames (cbt_settings.readShare, 0 = READ_SHARE_DEFAULT). Every polled bus owns
+*  READ_RESERVE slots of the read queue, the rest is shared: a bus can only use a
+*  shared slot if the reserves of the other busses stay free.
+*
+*  Busses from READ_FOREGROUND on are background busses: they are polled after the
+*  others and only when those have nothing pending, while their controller is in a
+*  receiving mode (kept up to date with setMode()), and they own no slots. So they never delay or crowd out a frame of busses 1 and 2.
+*/
+
+#define READ_SHARE_DEFAULT 4
+#define READ_SHARE_BACKGROUND 1
+#define READ_RESERVE 4
+#define READ_FOREGROUND 2  // Busses 1 and 2
+
+class BusScheduler
+{
+  public:
+    BusScheduler();
+    void begin(byte queueSize, byte nBusses);
+    byte busses() { return _nBusses; }
+    byte nextBus(byte n);
+    bool background(byte bus) { return bus >= READ_FOREGROUND; }
+    bool receives(byte bus);
+    void setMode(byte bus, CANMode mode);
+    byte share(byte bus);
+    bool admit(byte bus);
+    void queued(byte bus);
+    void released(byte bus);
+    void pending(byte bus);
+    void drained(byte bus);
+    void printStats(Stream* serial, byte bus);
+
+  private:
+    byte _queueSize;
+    byte _nBusses;
+    byte _first;
+    byte _receiving;               // Busses whose controller receives, one bit each
+    byte _inQueue[3];
+    unsigned long _waitStart[3];   // micros() when a pending frame was first seen, 0 = none
+    unsigned long _waitMax[3];
+    unsigned long _waitSum[3];
+    unsigned int _waitCount[3];
+    unsigned long _frames[3];
+    unsigned long _rejected[3];
+};
+
+BusScheduler busScheduler;
+
+
+BusScheduler::BusScheduler()
+{
+    begin(0, 0);
+}
+
+
+void BusScheduler::begin(byte queueSize, byte nBusses)
+{
+    _queueSize = queueSize;
+    _nBusses = nBusses;
+    _first = 0;
+    for (byte b = 0; b < 3; b++) {
+        _inQueue[b] = 0;
+        _waitStart[b] = _waitMax[b] = _waitSum[b] = 0;
+        _waitCount[b] = 0;
+        _frames[b] = _rejected[b] = 0;
+        setMode(b, cbt_settings.busCfg[b].mode);
+    }
+}
+
+
+// n-th bus to poll in this loop, the first foreground one rotates every loop
+byte BusScheduler::nextBus(byte n)
+{
+    byte foreground = min(_nBusses, READ_FOREGROUND);
+    if (n >= foreground) return n;
+    if (n == 0 && ++_first >= foreground) _first = 0;
+    byte bus = _first + n;
+    return (bus >= foreground)? bus - foreground : bus;
+}
+
+
+// Background busses are polled while their controller is set to receive
+bool BusScheduler::receives(byte bus)
+{
+    if (!background(bus)) return true;
+    if (!(_receiving & (1 << bus))) return false;
+    for (byte b = 0; b < READ_FOREGROUND; b++)
+        if (_waitStart[b] != 0) return false;
+    return true;
+}
+
+
+// Mode the controller of bus was switched to, it can differ from cbt_settings
+void BusScheduler::setMode(byte bus, CANMode mode)
+{
+    if (mode == NORMAL || mode == LISTEN || mode == LOOPBACK) _receiving |= 1 << bus;
+    else _receiving &= ~(1 << bus);
+}
+
+
+byte BusScheduler::share(byte bus)
+{
+    byte s = cbt_settings.readShare[bus];
+    if (s == 0) return background(bus)? READ_SHARE_BACKGROUND : READ_SHARE_DEFAULT;
+    return s;
+}
+
+
+bool BusScheduler::admit(byte bus)
+{
+    byte total = 0, othersReserved = 0;
+    for (byte b = 0; b < _nBusses; b++) {
+        total += _inQueue[b];
+        if (b != bus && !background(b) && _inQueue[b] < READ_RESERVE) othersReserved += READ_RESERVE - _inQueue[b];
+    }
+
+    bool reserved = !background(bus) && _inQueue[bus] < READ_RESERVE;
+    if (total < _queueSize && (reserved || _queueSize - total > othersReserved))
+        return true;
+    _rejected[bus]++;
+    return false;
+}
+
+
+void BusScheduler::queued(byte bus)
+{
+    _inQueue[bus]++;
+    _frames[bus]++;
+}
+
+
+void BusScheduler::released(byte bus)
+{
+    // Every frame in the read queue was queued(), received or replayed
+    if (bus < 3 && _inQueue[bus] > 0) _inQueue[bus]--;
+}
+
+
+void BusScheduler::pending(byte bus)
+{
+    if (_waitStart[bus] == 0) _waitStart[bus] = micros() | 1;
+}
+
+
+// All pending frames of the bus were read, account how long the oldest waited
+void BusScheduler::drained(byte bus)
+{
+    if (_waitStart[bus] == 0) return;
+    unsigned long wait = micros() - _waitStart[bus];
+    _waitStart[bus] = 0;
+    if (wait > _waitMax[bus]) _waitMax[bus] = wait;
+    if (_waitCount[bus] == 0xFFFF) {
+        _waitSum[bus] >>= 1;
+        _waitCount[bus] >>= 1;
+    }
+    _waitSum[bus] += wait;
+    _waitCount[bus]++;
+}
+
+
+void BusScheduler::printStats(Stream* serial, byte bus)
+{
+    serial->print( F("\", \"frames\":\"") );
+    serial->print( _frames[bus] );
+    serial->print( F("\", \"rejected\":\"") );
+    serial->print( _rejected[bus] );
+    serial->print( F("\", \"waitMax\":\"") );
+    serial->print( _waitMax[bus] );
+    serial->print( F("\", \"waitAvg\":\"") );
+    serial->print( (_waitCount[bus] > 0)? _waitSum[bus] / _waitCount[bus] : 0L );
+}
+
+#endif // BusScheduler_H
@@ -15,10 +15,16 @@
 #define RELAY_PIN A1
 
 #define BUILDNAME "CANBus EMA"
-#define BUILD_VERSION "0.6"
+#define BUILD_VERSION "0.7"
 
-#define READ_BUFFER_SIZE 20
-#define WRITE_BUFFER_SIZE 10
+#define READ_BUSSES 3 // Busses polled for received frames, bus 3 in background
+// Queue sizes are READ_HIGH_SIZE / READ_LOW_SIZE in ReadQueue.h and WRITE_BUFFER_SIZE in MessageRing.h
+
+// Optional middleware, off by default to leave SRAM for the stack.
+// After enabling one, check "minFree" in the 0x01 0x06 memory report.
+// #define FLIGHT_RECORDER  // About 330 bytes
+// #define BUS_ANALYZER     // About 330 bytes with the arrival stamps of the queued frames
+// #define FRAME_REPLAY     // About 290 bytes
 
 
 CANBus busses[] = {
@@ -26,66 +32,90 @@ CANBus busses[] = {
     CANBus(CAN2SELECT, CAN2RESET, 2, "Bus 2"),
     CANBus(CAN3SELECT, CAN3RESET, 3, "Bus 3")
 };
+const byte busIntPins[] = { CAN1INT_D, CAN2INT_D, CAN3INT_D };
+unsigned long busReadyUs = 0;   // micros() when the busses were configured
+unsigned long firstFrameUs = 0; // micros() when the first frame was read
 
 #include "Middleware.h"
+#include "Pipeline.h"
+#include "LoopWatchdog.h"
 #include "Settings.h"
+#include "BusScheduler.h"
+#include "Mcp2515Rx.h"
+#include "MessageRing.h"
+#include "ReadQueue.h"
 #include "SerialCommand.h"
+#include "FlightRecorder.h"
+#include "BusAnalyzer.h"
+#include "FrameReplay.h"
 #include "Mazda3CAN.h"
+#include "TripComputer.h"
+#include "SignalStats.h"
 #include "Mazda3Lcd.h"
 #include "CBTButtons.h"
+#include "RulesEngine.h"
+#include "SignalFeed.h"
+#include "PowerManager.h"
+#include "LedBlink.h"
 
-Message readBuffer[READ_BUFFER_SIZE];
-Message writeBuffer[WRITE_BUFFER_SIZE];
-MessageQueue readQueue(READ_BUFFER_SIZE, readBuffer);
-MessageQueue writeQueue(WRITE_BUFFER_SIZE, writeBuffer);
+Frame writeBuffer[WRITE_BUFFER_SIZE];
+ReadQueue readQueue;
+MessageRing writeQueue(WRITE_BUFFER_SIZE, writeBuffer);
 
 /*
 *  Middleware Setup
 *  http://docs.canb.us/firmware/main.html
 */
-SerialCommand *serialCommand = new SerialCommand( &writeQueue );
-Mazda3CAN *mazda3Can = new Mazda3CAN();
-Mazda3Lcd *mazda3Lcd = new Mazda3Lcd(mazda3Can, &writeQueue);
-CBTButtons *cbtButtons = new CBTButtons(mazda3Lcd, BLUE_LED, RELAY_PIN);
-
-Middleware *activeMw[] = { serialCommand, mazda3Can, mazda3Lcd, cbtButtons };
-int activeMwLength = (int)( sizeof(activeMw) / sizeof(activeMw[0]) );
+SerialCommand serialCommand( &writeQueue );
+Mazda3CAN mazda3Can;
+TripComputer tripComputer( &mazda3Can );
+SignalStats signalStats( &mazda3Can );
+Mazda3Lcd mazda3Lcd( &mazda3Can, &tripComputer, &signalStats, &writeQueue );
+CBTButtons cbtButtons( &mazda3Lcd, BLUE_LED, RELAY_PIN );
+RulesEngine rulesEngine( &mazda3Can, &mazda3Lcd, &cbtButtons );
+SignalFeed signalFeed( &mazda3Can, &serialCommand );
+PowerManager powerManager( &mazda3Can );
+LedBlink blueBlink( BLUE_LED );
+#ifdef FLIGHT_RECORDER
+FlightRecorder flightRecorder;
+#endif
+#ifdef BUS_ANALYZER
+BusAnalyzer busAnalyzer;
+#endif
+#ifdef FRAME_REPLAY
+FrameReplay frameReplay( &readQueue, &writeQueue );
+#endif
+
+// Active middleware, in processing order
+typedef Pipeline<
+    MW_STAGE(serialCommand),
+#ifdef BUS_ANALYZER
+    MW_STAGE(busAnalyzer),
+#endif
+#ifdef FLIGHT_RECORDER
+    MW_STAGE(flightRecorder),
+#endif
+    MW_STAGE(mazda3Can),
+    MW_STAGE(tripComputer),
+    MW_STAGE(signalStats),
+    MW_STAGE(mazda3Lcd),
+    MW_STAGE(cbtButtons),
+    MW_STAGE(rulesEngine),
+    MW_STAGE(signalFeed),
+#ifdef FRAME_REPLAY
+    MW_STAGE(frameReplay),
+#endif
+    MW_STAGE(powerManager),
+    MW_STAGE(bootBlink),
+    MW_STAGE(blueBlink)
+> MiddlewarePipeline;
 
 
 void setup()
 {
+    // CAN first, so the frames sent while the car powers up are received
+    BlockTransfer::recover();
     Settings::init();
-    delay(1);
-    mazda3Lcd->init(cbt_settings.displayIndex);
-
-    // Register additional serial command callback handlers
-    serialCommand->registerCommand(0xA0, 1, mazda3Can);
-    serialCommand->registerCommand(0xA1, 1, mazda3Lcd);
-
-    Serial.begin( 115200 ); // USB
-    Serial1.begin( 57600 ); // UART
-
-    /*
-    *  Power LED
-    */
-    DDRE |= B00000100;
-    PORTE |= B00000100;
-
-    /*
-    *  BLE112 Init
-    */
-    pinMode( BT_SLEEP, OUTPUT );
-    digitalWrite( BT_SLEEP, HIGH ); // Keep BLE112 Awake
-
-    /*
-    *  Boot LED
-    */
-    pinMode( BOOT_LED, OUTPUT );
-
-    /*
-    *  Blue LED
-    */
-    pinMode( BLUE_LED, OUTPUT );
 
     pinMode( CAN1INT_D, INPUT );
     pinMode( CAN2INT_D, INPUT );
@@ -129,22 +159,72 @@ void setup()
             for(int f = 2; f <= 5; f++) busses[b].setFilterSingle(f, 0x433); // Internal temperature
             busses[b].setMask(1, 0xFFFF); // Enable filter on buffer 1
         }
+        // Bus 3 receives everything, its filters are set with the 0x03 logging command
 
         busses[b].bitModify(RXB0CTRL, 0x04, 0x04); // Set buffer rollover enabled
         busses[b].setMode(cbt_settings.busCfg[b].mode);
     }
 
+    // Fastest SPI clock, 8MHz is within the MCP2515 limit of 10MHz
+    SPI.setClockDivider(SPI_CLOCK_DIV2);
+    busReadyUs = micros();
+
+    // Everything else runs while the controllers are already receiving
+    busScheduler.begin(READ_BUFFER_SIZE, READ_BUSSES);
+    mazda3Lcd.init(cbt_settings.displayIndex);
+    rulesEngine.begin();
+
+    // Register additional serial command callback handlers
+    serialCommand.registerCommand(0xA0, 1, &mazda3Can);
+    serialCommand.registerCommand(0xA1, 1, &mazda3Lcd);
+    serialCommand.registerCommand(0xA5, 3, &cbtButtons);
+    serialCommand.registerCommand(0xA6, 1, &tripComputer);
+    serialCommand.registerCommand(0xA7, 1, &powerManager);
+    serialCommand.registerCommand(0xA8, 1, &rulesEngine);
+    serialCommand.registerCommand(0xA9, 1, &signalStats);
+    serialCommand.registerCommand(0xAA, 1, &signalFeed);
+#ifdef FLIGHT_RECORDER
+    serialCommand.registerCommand(0xA2, 1, &flightRecorder);
+    cbtButtons.setRecorder(&flightRecorder);
+#endif
+#ifdef BUS_ANALYZER
+    serialCommand.registerCommand(0xA3, 1, &busAnalyzer);
+#endif
+#ifdef FRAME_REPLAY
+    serialCommand.registerCommand(0xA4, 1, &frameReplay);
+#endif
+
+    Serial.begin( 115200 ); // USB
+    Serial1.begin( 57600 ); // UART
+
+    /*
+    *  Power LED
+    */
+    DDRE |= B00000100;
+    PORTE |= B00000100;
+
+    /*
+    *  BLE112 Init
+    */
+    pinMode( BT_SLEEP, OUTPUT );
+    digitalWrite( BT_SLEEP, HIGH ); // Keep BLE112 Awake
+
+    /*
+    *  Boot LED
+    */
+    pinMode( BOOT_LED, OUTPUT );
+
+    /*
+    *  Blue LED
+    */
+    pinMode( BLUE_LED, OUTPUT );
+
     // Start button listening
-    cbtButtons->begin();
+    cbtButtons.begin();
 
-    for(int l = 0; l < 5; l++) {
-        digitalWrite( BLUE_LED, HIGH );
-        delay(100);
-        digitalWrite( BLUE_LED, LOW );
-        delay(100);
-    }
+    blueBlink.start(5, 200);
 
-    // wdt_enable(WDTO_1S);
+    LoopWatchdog::begin();
 }
 
 
@@ -154,30 +234,41 @@ void setup()
 void loop() 
 {
     // Run all middleware ticks
-    for(int i = 0; i <= activeMwLength - 1; i++) activeMw[i]->tick();
-
-    if (digitalRead(CAN1INT_D) == 0) readBus(&busses[0]);
-    if (digitalRead(CAN2INT_D) == 0) readBus(&busses[1]);
+    MiddlewarePipeline::tick();
+
+    // Read busses round robin, each one up to its share of frames
+    for (byte n = 0; n < READ_BUSSES; n++) {
+        byte b = busScheduler.nextBus(n);
+        if (!busScheduler.receives(b)) continue;
+        LoopWatchdog::stage(STAGE_READ_BUS, b + 1);
+        if (digitalRead(busIntPins[b]) == 0) readBus(&busses[b]);
+    }
 
     // Process received CAN message through middleware
-    if (!readQueue.isEmpty()) {
-        Message msg = readQueue.pop();
-        for(int i = 0; i < activeMwLength; i++) msg = activeMw[i]->process(msg);
+    Frame *slot = readQueue.peek();
+    if (slot != NULL) {
+        Message msg;
+        slot->unpack(msg);
+#ifdef BUS_ANALYZER
+        busAnalyzer.arrived(slot->stamp);
+#endif
+        readQueue.release();
+        busScheduler.released(msg.busId - 1);
+        MiddlewarePipeline::process(msg);
         if (msg.dispatch) writeQueue.push(msg);
     }
 
-    bool error = false;
-    while(!writeQueue.isEmpty() && !error) {
-        Message msg = writeQueue.pop();
-	if (msg.dispatch) {
-	    error = !sendMessage(msg, &busses[msg.busId - 1]);
-            // When TX Failure, add back to queue
-            if (error) writeQueue.push(msg);
+    // Send queued messages in place, on TX failure the message stays at the head
+    while ((slot = writeQueue.peek()) != NULL) {
+        if (slot->dispatch()) {
+            LoopWatchdog::stage(STAGE_SEND, slot->busId());
+            if (!sendMessage(*slot, &busses[slot->busId() - 1])) break;
         }
+        writeQueue.release();
     }
 
     // Pet the dog
-    // wdt_reset();
+    LoopWatchdog::endLoop();
 
 } // End loop()
 
@@ -185,15 +276,20 @@ void loop()
 /*
 *  Load CAN Controller buffer and set send flag
 */
-bool sendMessage( Message msg, CANBus * bus )
+bool sendMessage( Frame &frame, CANBus * bus )
 {
     int txBuf = bus->getNextTxBuffer();
     if (txBuf < 0 || txBuf > 2) return false; // All TX buffers full
 
     digitalWrite(BOOT_LED, HIGH);
-    bus->loadFullFrame(txBuf, msg.length, msg.frame_id, msg.frame_data );
+    bus->loadFullFrame(txBuf, frame.length(), frame.id(), frame.data );
     bus->transmitBuffer(txBuf);
     digitalWrite(BOOT_LED, LOW );
+#ifdef FLIGHT_RECORDER
+    Message msg;
+    frame.unpack(msg);
+    flightRecorder.record(msg, true);
+#endif
     delay(1);
     return true;
 }
@@ -204,25 +300,52 @@ bool sendMessage( Message msg, CANBus * bus )
 */
 void readBus( CANBus * bus )
 {
-    byte rx_status = 0x3;
-    bool bufferAvailable = true;
-    while((rx_status & 0x3) && bufferAvailable) {
-        rx_status = bus->readStatus();
-        if (rx_status & 0x1) 
-            bufferAvailable = readMsgFromBuffer(bus, 0, rx_status);
-        if ((rx_status & 0x2) && bufferAvailable) 
-            bufferAvailable = readMsgFromBuffer(bus, 1, rx_status);
+    byte b = bus->busId - 1;
+    byte quota = busScheduler.share(b);
+    bool foreground = !busScheduler.background(b);
+    busScheduler.pending(b);
+    while (quota > 0) {
+        byte rx_status = busRx[b].rxStatus();
+        if (rx_status & RX_STATUS_RXB0) {
+            if (!readMsgFromBuffer(bus, 0, foreground, rx_status)) break;
+            quota--;
+        }
+        else if (rx_status & RX_STATUS_RXB1) {
+            // High priority if it rolled over from RXB0
+            bool high = foreground && busRx[b].rolledOver();
+            if (!readMsgFromBuffer(bus, 1, high, rx_status)) break;
+            quota--;
+        }
+        else break;
     }
+    if (digitalRead(busIntPins[b]) == 1) busScheduler.drained(b);
 }
 
 
-bool readMsgFromBuffer(CANBus * bus, byte bufferId, byte rx_status)
+/*
+*  High priority frames (RX buffer 0 and its rollover into RX buffer 1) go in the
+*  high lane of the read queue, the rest and all frames of background busses in the low lane.
+*  When there is no room, high priority frames wait in the controller while
+*  low priority ones are dropped, keeping RX buffer 1 free for rollover.
+*/
+bool readMsgFromBuffer(CANBus * bus, byte bufferId, bool high, byte rx_status)
 {
-    if (readQueue.isFull()) return false;
-    Message msg;
-    msg.busStatus = rx_status;
-    msg.busId = bus->busId;
-    msg.dispatch = false;
-    bus->readFullFrame(bufferId, &msg.length, msg.frame_data, &msg.frame_id );  
-    return readQueue.push(msg);
+    byte b = bus->busId - 1;
+    bool admitted = readQueue.canPush(high) && busScheduler.admit(b);
+    if (!admitted && high) return false;
+
+    if (!admitted) {
+        busRx[b].discard(bufferId);
+        readQueue.dropped(high);
+        return true;
+    }
+
+    // Read straight into the queue slot
+    Frame *frame = readQueue.reserve(high);
+    frame->set(bus->busId, 0, 0, false, rx_status >> 6); // RX0IF / RX1IF as READ STATUS reports them
+    busRx[b].readFrame(bufferId, frame);
+    readQueue.commit(high);
+    busScheduler.queued(b);
+    if (firstFrameUs == 0) firstFrameUs = micros() | 1;
+    return true;
 }
@@ -4,6 +4,19 @@
 #include <avr/interrupt.h>
 #include "Mazda3Lcd.h"
 
+/*
+// Button commands
+------------------
+0xA5 BUTTON GESTURE ACTION     Bind ACTION to GESTURE of BUTTON (ACTION 0 = unbind)
+
+Buttons:  0 = Clock (A4), 1 = Info (A4), 2 = Relay (A5), 3 = Display mode (A5)
+Gestures: 0 = Press, 1 = Release, 2 = Long press, 3 = Double press
+Actions:  see BUTTON_ACTION_*
+
+When a button has a long or double press bound, its press action runs on release
+(after the double press interval) so that the gestures don't also fire a press.
+*/
+
 // Corrispondenza pin Arduino, canali ADC Atmega32u4:
 // A4 -> ADC1
 // A5 -> ADC0
@@ -15,39 +28,105 @@
 #define ADMUX_A5 B01100000 // VCC as voltage reference and ADC0 as conversion channel (pin A5)
 
 // ADEN  = 1 -> ADC Enabled
-// ADSC  = 1 -> Start conversion 
+// ADSC  = 1 -> Start conversion
 // ADATE = 0 -> Auto Trigger disabled
 // ADIF  = 0 -> (Interrupt flag)
 // ADIE  = 1 -> ADC interrupt enabled
 // ADPS  = 111 -> Division factor = 128
 #define ADC_start() ( ADCSRA = B11001111 )
 
+#define BTN_OVERSAMPLE_SHIFT 2  // 4 readings averaged, about 1200 averages/s per channel
+#define BTN_STABLE 24           // Averages a new level must hold, about 20 ms
+#define BTN_QUEUE_SIZE 8        // Must be a power of 2
+#define BTN_LONG_PRESS 800      // ms
+#define BTN_DOUBLE_PRESS 300    // ms between release and the second press
+
+#define N_BUTTONS 4
+#define N_GESTURES 4
+#define GESTURE_PRESS 0
+#define GESTURE_RELEASE 1
+#define GESTURE_LONG_PRESS 2
+#define GESTURE_DOUBLE_PRESS 3
+
+#define BUTTON_ACTION_NONE 0
+#define BUTTON_ACTION_INFO 1
+#define BUTTON_ACTION_CLOCK 2
+#define BUTTON_ACTION_NEXT_MODE 3
+#define BUTTON_ACTION_PREV_MODE 4
+#define BUTTON_ACTION_TOGGLE_RELAY 5
+#define BUTTON_ACTION_RECORDER 6
+
+struct button_event {
+    byte level;        // bit 7: channel (0 = A4, 1 = A5), bits 0-1: ladder level
+    unsigned int time; // millis() when the level became stable
+};
+
+// Lock free ring, the ISR only writes btnHead and the main loop only writes btnTail
+volatile struct button_event btnQueue[BTN_QUEUE_SIZE];
+volatile byte btnHead, btnTail;
+volatile byte btnOverflows;
 
-volatile byte a4_lev, a5_lev;
-volatile unsigned long a4_msec, a5_msec;
+// ADC state per channel, only touched by the ISR
+unsigned int btnSum[2];
+byte btnSamples[2];
+byte btnLevel[2], btnCandidate[2], btnStable[2];
 
 class CBTButtons : public Middleware
-{   
+{
 public:
     CBTButtons(Mazda3Lcd *mazda_lcd, int led, int relay_pin);
     void begin();
     void tick();
+    void commandHandler(byte* bytes, int length, Stream* activeSerial);
+    void bind(byte button, byte gesture, byte action);
+    void setRelay(bool on);
+#ifdef FLIGHT_RECORDER
+    void setRecorder(FlightRecorder *recorder) { _recorder = recorder; }
+#endif
 
 private:
     int _led;
     int _relay_pin;
     bool _relay_status;
-    byte _curLev4;
-    byte _curLev5;
+    byte _curLev[2];
+    byte _bindings[N_BUTTONS][N_GESTURES];
+    // Gesture decoder state, one bit per button
+    byte _down;
+    byte _longFired;
+    byte _clickPending;
+    byte _secondPress;
+    unsigned int _pressTime[N_BUTTONS];
+    unsigned int _releaseTime[N_BUTTONS];
     Mazda3Lcd* _lcd;
+#ifdef FLIGHT_RECORDER
+    FlightRecorder* _recorder;
+#endif
 
+    void onPress(byte button, unsigned int time);
+    void onRelease(byte button, unsigned int time);
+    bool deferPress(byte button);
+    void fire(byte button, byte gesture);
     void toggleRelay();
 };
 
-CBTButtons::CBTButtons(Mazda3Lcd *mazda_lcd, int led, int relay_pin) 
-    : _curLev4(0), _curLev5(0), _led(led), _relay_pin(relay_pin)
+CBTButtons::CBTButtons(Mazda3Lcd *mazda_lcd, int led, int relay_pin)
+    : _led(led), _relay_pin(relay_pin), _down(0), _longFired(0), _clickPending(0), _secondPress(0)
 {
     _lcd = mazda_lcd;
+    _curLev[0] = _curLev[1] = 0;
+#ifdef FLIGHT_RECORDER
+    _recorder = NULL;
+#endif
+
+    memset(_bindings, BUTTON_ACTION_NONE, sizeof(_bindings));
+    _bindings[0][GESTURE_PRESS] = BUTTON_ACTION_CLOCK;
+    _bindings[1][GESTURE_PRESS] = BUTTON_ACTION_INFO;
+    _bindings[2][GESTURE_PRESS] = BUTTON_ACTION_TOGGLE_RELAY;
+#ifdef FLIGHT_RECORDER
+    _bindings[2][GESTURE_LONG_PRESS] = BUTTON_ACTION_RECORDER;
+#endif
+    _bindings[3][GESTURE_PRESS] = BUTTON_ACTION_NEXT_MODE;
+    _bindings[3][GESTURE_LONG_PRESS] = BUTTON_ACTION_PREV_MODE;
 };
 
 void CBTButtons::begin()
@@ -70,54 +149,182 @@ byte getLevel(unsigned char val)
 }
 
 ISR(ADC_vect) {
-    byte level = getLevel(ADCH);
-    if (ADMUX == ADMUX_A4) { 
+    byte val = ADCH;
+    byte ch;
+    if (ADMUX == ADMUX_A4) {
         // Reading from ADC1 (pin A4)
-        if (level != a4_lev) {
-            a4_lev = level;
-            a4_msec = millis();
-        }
+        ch = 0;
         ADMUX = ADMUX_A5; // Switch to channel ADC0
-    } else { 
+    } else {
         // Reading from ADC0 (pin A5)
-        if (level != a5_lev) {
-            a5_lev = level;
-            a5_msec = millis();
-        }
+        ch = 1;
         ADMUX = ADMUX_A4; // Switch to channel ADC1
     }
     ADC_start();
+
+    btnSum[ch] += val;
+    if (++btnSamples[ch] < (1 << BTN_OVERSAMPLE_SHIFT)) return;
+    byte level = getLevel(btnSum[ch] >> BTN_OVERSAMPLE_SHIFT);
+    btnSum[ch] = 0;
+    btnSamples[ch] = 0;
+
+    // Debounce: the new level must hold for BTN_STABLE averages
+    if (level == btnLevel[ch]) {
+        btnStable[ch] = 0;
+        return;
+    }
+    if (level != btnCandidate[ch] || btnStable[ch] == 0) {
+        btnCandidate[ch] = level;
+        btnStable[ch] = 1;
+        return;
+    }
+    if (++btnStable[ch] < BTN_STABLE) return;
+    btnLevel[ch] = level;
+    btnStable[ch] = 0;
+
+    byte next = (btnHead + 1) & (BTN_QUEUE_SIZE - 1);
+    if (next == btnTail) {
+        btnOverflows++;
+        return;
+    }
+    btnQueue[btnHead].level = (ch << 7) | level;
+    btnQueue[btnHead].time = (unsigned int)millis();
+    btnHead = next;
 }
 
 
 void CBTButtons::tick()
 {
-    bool changed = false;
-    if (a4_lev != _curLev4 && (millis() - a4_msec) > 50) {        
-        _lcd->buttonInfo = (a4_lev & 0x2) != 0;
-        _lcd->buttonClock = (a4_lev & 0x1) != 0;
-
-        // Detect button pressed
-        if (_lcd->buttonInfo && (_curLev4 & 0x2) == 0) _lcd->pushInfo();
-        else if (_lcd->buttonClock && (_curLev4 & 0x1) == 0) _lcd->pushClock();
-        _curLev4 = a4_lev;
-        changed = true;
+    // Decode queued level changes with the time they happened, even if the loop stalled
+    while (btnTail != btnHead) {
+        byte ch = btnQueue[btnTail].level >> 7;
+        byte level = btnQueue[btnTail].level & 0x3;
+        unsigned int time = btnQueue[btnTail].time;
+        btnTail = (btnTail + 1) & (BTN_QUEUE_SIZE - 1);
+
+        byte changed = level ^ _curLev[ch];
+        for (byte bit = 0; bit < 2; bit++) {
+            if ((changed & (1 << bit)) == 0) continue;
+            if (level & (1 << bit)) onPress(ch * 2 + bit, time);
+            else onRelease(ch * 2 + bit, time);
+        }
+        _curLev[ch] = level;
+
+        _lcd->buttonClock = (_curLev[0] & 0x1) != 0;
+        _lcd->buttonInfo = (_curLev[0] & 0x2) != 0;
+        digitalWrite(_led, (_curLev[0] || _curLev[1] || _relay_status)? HIGH : LOW);
+    }
+
+    // Gestures that depend on time passing
+    unsigned int now = (unsigned int)millis();
+    for (byte b = 0; b < N_BUTTONS; b++) {
+        byte mask = 1 << b;
+        if ((_down & mask) && !(_longFired & mask) && (now - _pressTime[b]) >= BTN_LONG_PRESS) {
+            _longFired |= mask;
+            fire(b, GESTURE_LONG_PRESS);
+        }
+        if ((_clickPending & mask) && (now - _releaseTime[b]) > BTN_DOUBLE_PRESS) {
+            _clickPending &= ~mask;
+            fire(b, GESTURE_PRESS);
+        }
+    }
+}
+
+
+bool CBTButtons::deferPress(byte button)
+{
+    return _bindings[button][GESTURE_LONG_PRESS] != BUTTON_ACTION_NONE
+        || _bindings[button][GESTURE_DOUBLE_PRESS] != BUTTON_ACTION_NONE;
+}
+
+
+void CBTButtons::onPress(byte button, unsigned int time)
+{
+    byte mask = 1 << button;
+    _down |= mask;
+    _longFired &= ~mask;
+    _pressTime[button] = time;
+
+    if ((_clickPending & mask) && (time - _releaseTime[button]) <= BTN_DOUBLE_PRESS) {
+        _clickPending &= ~mask;
+        _secondPress |= mask;
+        fire(button, GESTURE_DOUBLE_PRESS);
     }
-    if (a5_lev != _curLev5 && (millis() - a5_msec) > 50) {
-        // Detect button pressed
-        if ((a5_lev & 0x1) != 0 && (_curLev5 & 0x1) == 0) toggleRelay();
-        else if ((a5_lev & 0x2) != 0 && (_curLev5 & 0x2) == 0) _lcd->nextDisplayMode();
-        _curLev5 = a5_lev;
-        changed = true;
+    else if (!deferPress(button)) fire(button, GESTURE_PRESS);
+}
+
+
+void CBTButtons::onRelease(byte button, unsigned int time)
+{
+    byte mask = 1 << button;
+    _down &= ~mask;
+    _releaseTime[button] = time;
+    fire(button, GESTURE_RELEASE);
+
+    if (_secondPress & mask) _secondPress &= ~mask;
+    else if ((_longFired & mask) == 0 && deferPress(button)) {
+        if (_bindings[button][GESTURE_DOUBLE_PRESS] != BUTTON_ACTION_NONE) _clickPending |= mask;
+        else fire(button, GESTURE_PRESS);
     }
-    if (changed) digitalWrite(_led, (_curLev4 || _curLev5 || _relay_status)? HIGH : LOW);
+}
+
+
+void CBTButtons::fire(byte button, byte gesture)
+{
+    switch(_bindings[button][gesture]) {
+        case BUTTON_ACTION_INFO:
+            _lcd->pushInfo();
+            break;
+        case BUTTON_ACTION_CLOCK:
+            _lcd->pushClock();
+            break;
+        case BUTTON_ACTION_NEXT_MODE:
+            _lcd->nextDisplayMode();
+            break;
+        case BUTTON_ACTION_PREV_MODE:
+            _lcd->prevDisplayMode();
+            break;
+        case BUTTON_ACTION_TOGGLE_RELAY:
+            toggleRelay();
+            break;
+#ifdef FLIGHT_RECORDER
+        case BUTTON_ACTION_RECORDER:
+            if (_recorder) _recorder->trigger();
+            break;
+#endif
+    }
+}
+
+
+void CBTButtons::bind(byte button, byte gesture, byte action)
+{
+    if (button < N_BUTTONS && gesture < N_GESTURES) _bindings[button][gesture] = action;
+}
+
+
+void CBTButtons::commandHandler(byte* bytes, int length, Stream* activeSerial)
+{
+    if (length < 3 || bytes[0] >= N_BUTTONS || bytes[1] >= N_GESTURES) {
+        activeSerial->write(COMMAND_ERROR);
+        return;
+    }
+    bind(bytes[0], bytes[1], bytes[2]);
+    activeSerial->write(COMMAND_OK);
+    activeSerial->write(NEWLINE);
 }
 
 
 void CBTButtons::toggleRelay()
 {
-    _relay_status = !_relay_status;
+    setRelay(!_relay_status);
+}
+
+
+void CBTButtons::setRelay(bool on)
+{
+    _relay_status = on;
     digitalWrite(_relay_pin, _relay_status? HIGH : LOW);
+    digitalWrite(_led, (_curLev[0] || _curLev[1] || _relay_status)? HIGH : LOW);
 }
 
-#endif // CBTButtons_H
\ No newline at end of file
+#endif // CBTButtons_H
@@ -0,0 +1,233 @@
+#ifndef FlightRecorder_H
+#define FlightRecorder_H
+
+#include <MessageQueue.h>
+#include "Middleware.h"
+
+/*
+// Flight recorder commands
+---------------------------
+0xA2 0x00                      Print recorder status
+0xA2 0x01 POST                 Clear and arm, keep POST frames after the trigger (optional, default FR_DEFAULT_POST)
+0xA2 0x02                      Trigger now
+0xA2 0x03                      Dump captured frames
+0xA2 0x04 BUS IDH IDL          Trigger on message id (BUS 0 = any bus, id 0xFFFF = disabled)
+0xA2 0x05 MASK0-7 VALUE0-7     Trigger when (data & MASK) == VALUE (all zero mask = disabled)
+*/
+
+#define FR_BUFFER_SIZE 24  // 13 bytes each
+#define FR_DEFAULT_POST 8
+#define FR_NO_ID 0xFFFF
+
+#define FR_ARMED 0
+#define FR_TRIGGERED 1
+#define FR_FROZEN 2
+
+struct recorded_frame {
+    unsigned int time; // micros() / 256, wraps every 16.7 s
+    unsigned int id;   // bits 0-10: frame id, bits 11-12: bus id, bit 15: transmitted
+    byte length;
+    byte data[8];
+};
+
+class FlightRecorder : public Middleware
+{
+public:
+    FlightRecorder();
+    Message process(Message msg);
+    void commandHandler(byte* bytes, int length, Stream* activeSerial);
+    void record(const Message &msg, bool transmitted);
+    void trigger();
+    void arm(byte postFrames);
+
+private:
+    struct recorded_frame _frames[FR_BUFFER_SIZE];
+    byte _head;  // Next slot to write
+    byte _count;
+    byte _state;
+    byte _post; // Frames still to capture after the trigger
+    byte _postFrames;
+    byte _triggerSlot;
+    byte _trigBus;
+    unsigned int _trigId;
+    bool _trigMaskEnabled;
+    byte _trigMask[8];
+    byte _trigValue[8];
+
+    bool matchTrigger(const Message &msg);
+    void dump(Stream* serial);
+    void printStatus(Stream* serial);
+};
+
+FlightRecorder::FlightRecorder()
+    : _trigBus(0), _trigId(FR_NO_ID), _trigMaskEnabled(false)
+{
+    memset(_trigMask, 0, 8);
+    memset(_trigValue, 0, 8);
+    arm(FR_DEFAULT_POST);
+}
+
+void FlightRecorder::arm(byte postFrames)
+{
+    if (postFrames >= FR_BUFFER_SIZE) postFrames = FR_BUFFER_SIZE - 1;
+    _postFrames = postFrames;
+    _head = _count = _post = _triggerSlot = 0;
+    _state = FR_ARMED;
+}
+
+Message FlightRecorder::process(Message msg)
+{
+    record(msg, false);
+    return msg;
+}
+
+void FlightRecorder::record(const Message &msg, bool transmitted)
+{
+    if (_state == FR_FROZEN) return;
+
+    struct recorded_frame *f = &_frames[_head];
+    f->time = (unsigned int)(micros() >> 8);
+    f->id = (msg.frame_id & 0x7FF) | ((unsigned int)(msg.busId & 0x3) << 11) | (transmitted? 0x8000 : 0);
+    f->length = msg.length;
+    memcpy(f->data, msg.frame_data, 8);
+
+    byte slot = _head;
+    if (++_head == FR_BUFFER_SIZE) _head = 0;
+    if (_count < FR_BUFFER_SIZE) _count++;
+
+    if (_state == FR_TRIGGERED) {
+        if (--_post == 0) _state = FR_FROZEN;
+    }
+    else if (!transmitted && matchTrigger(msg)) {
+        _triggerSlot = slot;
+        _state = FR_TRIGGERED;
+        _post = _postFrames;
+        if (_post == 0) _state = FR_FROZEN;
+    }
+}
+
+bool FlightRecorder::matchTrigger(const Message &msg)
+{
+    if (_trigId == FR_NO_ID && !_trigMaskEnabled) return false;
+    if (_trigId != FR_NO_ID) {
+        if (msg.frame_id != _trigId) return false;
+        if (_trigBus != 0 && msg.busId != _trigBus) return false;
+    }
+    if (_trigMaskEnabled) {
+        for (byte i = 0; i < 8; i++)
+            if ((msg.frame_data[i] & _trigMask[i]) != _trigValue[i]) return false;
+    }
+    return true;
+}
+
+void FlightRecorder::trigger()
+{
+    if (_state != FR_ARMED) return;
+    // The last recorded frame is the trigger point
+    _triggerSlot = (_head == 0)? FR_BUFFER_SIZE - 1 : _head - 1;
+    _state = FR_TRIGGERED;
+    _post = _postFrames;
+    if (_post == 0) _state = FR_FROZEN;
+}
+
+void FlightRecorder::commandHandler(byte* bytes, int length, Stream* activeSerial)
+{
+    if (length == 0) {
+        activeSerial->write(COMMAND_ERROR);
+        return;
+    }
+
+    byte cmd[16];
+    switch(bytes[0]) {
+        case 0x00:
+            printStatus(activeSerial);
+            return;
+        case 0x01:
+            arm((readSerialBytes(activeSerial, cmd, 1) == 1)? cmd[0] : FR_DEFAULT_POST);
+            break;
+        case 0x02:
+            trigger();
+            break;
+        case 0x03:
+            dump(activeSerial);
+            return;
+        case 0x04:
+            if (readSerialBytes(activeSerial, cmd, 3) != 3) {
+                activeSerial->write(COMMAND_ERROR);
+                return;
+            }
+            _trigBus = cmd[0];
+            _trigId = (cmd[1] << 8) + cmd[2];
+            break;
+        case 0x05:
+            if (readSerialBytes(activeSerial, cmd, 16) != 16) {
+                activeSerial->write(COMMAND_ERROR);
+                return;
+            }
+            _trigMaskEnabled = false;
+            for (byte i = 0; i < 8; i++) {
+                _trigMask[i] = cmd[i];
+                _trigValue[i] = cmd[8 + i] & cmd[i];
+                if (cmd[i] != 0) _trigMaskEnabled = true;
+            }
+            break;
+        default:
+            activeSerial->write(COMMAND_ERROR);
+            return;
+    }
+    activeSerial->write(COMMAND_OK);
+    activeSerial->write(NEWLINE);
+}
+
+void FlightRecorder::printStatus(Stream* serial)
+{
+    serial->print( F("{\"event\":\"recorder\", \"state\":") );
+    serial->print(_state);
+    serial->print( F(", \"frames\":") );
+    serial->print(_count);
+    serial->print( F(", \"post\":") );
+    serial->print(_postFrames);
+    serial->print( F(", \"triggerId\":\"") );
+    serial->print(_trigId, HEX);
+    serial->println( F("\"}") );
+}
+
+void FlightRecorder::dump(Stream* serial)
+{
+    // Stop recording while dumping, so the buffer doesn't change under us
+    byte state = _state;
+    _state = FR_FROZEN;
+
+    // Times are relative to the trigger frame, or to the newest frame when not triggered
+    byte slot = (_count < FR_BUFFER_SIZE)? 0 : _head;
+    byte refSlot = (state != FR_ARMED)? _triggerSlot : ((_head == 0)? FR_BUFFER_SIZE - 1 : _head - 1);
+    unsigned int refTime = _frames[refSlot].time;
+    for (byte n = 0; n < _count; n++) {
+        struct recorded_frame *f = &_frames[slot];
+        serial->print( F("{\"event\":\"recorder-frame\", \"n\":") );
+        serial->print(n);
+        serial->print( F(", \"t\":") );
+        serial->print((long)(int)(f->time - refTime) * 256L);
+        serial->print( F(", \"trigger\":") );
+        serial->print((state != FR_ARMED && slot == _triggerSlot)? 1 : 0);
+        serial->print( F(", \"tx\":") );
+        serial->print((f->id & 0x8000)? 1 : 0);
+        serial->print( F(", \"bus\":") );
+        serial->print((f->id >> 11) & 0x3);
+        serial->print( F(", \"id\":\"") );
+        serial->print(f->id & 0x7FF, HEX);
+        serial->print( F("\", \"length\":") );
+        serial->print(f->length);
+        serial->print( F(", \"data\":\"") );
+        for (byte i = 0; i < 8; i++) {
+            if (f->data[i] < 0x10) serial->print( "0" );
+            serial->print(f->data[i], HEX);
+        }
+        serial->println( F("\"}") );
+        if (++slot == FR_BUFFER_SIZE) slot = 0;
+    }
+    _state = state;
+    printStatus(serial);
+}
+
+#endif // FlightRecorder_H
@@ -0,0 +1,62 @@
+#ifndef Frame_H
+#define Frame_H
+
+#include <string.h>
+#include <MessageQueue.h>
+
+/*
+*  Packed frame, the slot type of the read and write queues
+*
+*  info:   bus id (bits 6-7), dispatch (bit 5), DLC (bits 0-3)
+*  idHigh: READ STATUS RX flags (bits 3-4), id bits 8-10 (bits 0-2)
+*  idLow:  id bits 0-7
+*
+*  11 bytes instead of the 14 of Message. Frames are filled and sent in place,
+*  middleware still gets a Message, see unpack().
+*  With BUS_ANALYZER a frame also carries when it was read from the controller.
+*/
+
+#define FRAME_DISPATCH 0x20
+#define FRAME_LENGTH 0x0F
+#define FRAME_STAMP_SHIFT 6  // Arrival stamps in 64 us units
+
+struct Frame {
+    byte info;
+    byte idHigh;
+    byte idLow;
+    byte data[8];
+#ifdef BUS_ANALYZER
+    unsigned int stamp;  // micros() >> FRAME_STAMP_SHIFT when set()
+#endif
+
+    unsigned short id() const { return ((unsigned short)(idHigh & 0x07) << 8) | idLow; }
+    byte length() const { return info & FRAME_LENGTH; }
+    byte busId() const { return info >> 6; }
+    bool dispatch() const { return info & FRAME_DISPATCH; }
+    byte busStatus() const { return (idHigh >> 3) & 0x03; }
+
+    void set(byte bus, unsigned short frameId, byte len, bool send, byte status = 0) {
+        info = (bus << 6) | (send? FRAME_DISPATCH : 0) | (len & FRAME_LENGTH);
+        idHigh = ((status & 0x03) << 3) | ((frameId >> 8) & 0x07);
+        idLow = frameId;
+#ifdef BUS_ANALYZER
+        stamp = micros() >> FRAME_STAMP_SHIFT;
+#endif
+    }
+
+    void pack(const Message &msg) {
+        set(msg.busId, msg.frame_id, msg.length, msg.dispatch, msg.busStatus);
+        memcpy(data, msg.frame_data, 8);
+    }
+
+    void unpack(Message &msg) const {
+        msg.busStatus = busStatus();
+        msg.length = length();
+        msg.frame_id = id();
+        memcpy(msg.frame_data, data, 8);
+        msg.dispatch = dispatch();
+        msg.busId = busId();
+    }
+};
+
+#endif // Frame_H
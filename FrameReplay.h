@@ -0,0 +1,273 @@
+#ifndef FrameReplay_H
+#define FrameReplay_H
+
+#include <MessageQueue.h>
+#include "MessageRing.h"
+#include "Middleware.h"
+#include "ReadQueue.h"
+#include "BusScheduler.h"
+
+/*
+// Frame replay commands
+------------------------
+0xA4 0x01 N REC*N                     Append N frames, replies with the free slots
+                                      REC = DELTA(4) BUS IDH IDL LEN D0-D7, DELTA is us after the previous frame
+0xA4 0x02 TARGET FLAGS SPEEDH SPEEDL  Start playing
+                                      TARGET: 0 = bus of each frame, 1-3 = that bus, 0xFF = middleware as received
+                                      FLAGS bit 0: loop over the buffered frames, they must span more than 0 us
+                                      SPEED is 8.8 fixed point, 0x0100 = real time, 0x0200 = twice as fast
+0xA4 0x03                             Stop
+0xA4 0x04                             Print status and schedule drift
+0xA4 0x05                             Stop and clear the buffer
+
+Frames can be appended while playing, the host keeps the buffer topped up using the free count.
+Frames that can't be queued, or have a bus outside 1-3 or more than 8 bytes, count as dropped.
+Underruns count the times the buffer ran dry while playing and the host appended more later.
+*/
+
+#define REPLAY_BUFFER_SIZE 16  // 16 bytes each
+#define REPLAY_SPIN_US 400     // Busy wait when the next frame is due sooner than this
+#define REPLAY_BURST 8         // Frames injected per tick at most, the rest wait for the next one
+#define REPLAY_RECORD_SIZE 16
+#define REPLAY_TO_PIPELINE 0xFF
+
+struct replay_frame {
+    unsigned long delta;
+    byte busId;
+    unsigned short frame_id;
+    byte length;
+    byte data[8];
+};
+
+class FrameReplay : public Middleware
+{
+public:
+    FrameReplay(ReadQueue *readQueue, MessageRing *writeQueue);
+    void tick();
+    void commandHandler(byte* bytes, int length, Stream* activeSerial);
+
+private:
+    struct replay_frame _frames[REPLAY_BUFFER_SIZE];
+    ReadQueue* _readQueue;
+    MessageRing* _writeQueue;
+    byte _first;    // Oldest buffered frame
+    byte _count;
+    byte _played;   // Frames played from _first when looping
+    bool _playing;
+    bool _starved;  // Ran out of frames, schedule restarts on the next append
+    bool _loop;
+    byte _target;
+    unsigned int _speed;
+    unsigned long _due; // micros() when the next frame is due
+    unsigned long _sent;
+    unsigned long _dropped;
+    unsigned int _underruns;
+    unsigned long _driftMax;
+    unsigned long _driftSum;
+
+    bool append(Stream* serial);
+    bool start(byte target, byte flags, unsigned int speed);
+    bool inject(struct replay_frame *f);
+    unsigned long scaled(unsigned long delta);
+    struct replay_frame* nextFrame();
+    void printStatus(Stream* serial);
+};
+
+FrameReplay::FrameReplay(ReadQueue *readQueue, MessageRing *writeQueue)
+    : _first(0), _count(0), _played(0), _playing(false), _starved(false), _loop(false),
+      _target(0), _speed(0x100), _due(0), _sent(0), _dropped(0), _underruns(0), _driftMax(0), _driftSum(0)
+{
+    _readQueue = readQueue;
+    _writeQueue = writeQueue;
+}
+
+unsigned long FrameReplay::scaled(unsigned long delta)
+{
+    // delta * 256 / speed without overflowing 32 bits
+    return (delta / _speed) * 256L + ((delta % _speed) * 256L) / _speed;
+}
+
+struct replay_frame* FrameReplay::nextFrame()
+{
+    byte index = _loop? _played : 0;
+    if (index >= _count) return NULL;
+    return &_frames[(_first + index) % REPLAY_BUFFER_SIZE];
+}
+
+void FrameReplay::tick()
+{
+    if (!_playing || _starved) return;
+
+    struct replay_frame *f;
+    byte burst = 0;
+    while ((f = nextFrame()) != NULL) {
+        if (burst++ == REPLAY_BURST) return;
+        long wait = (long)(_due - micros());
+        if (wait > REPLAY_SPIN_US) return;
+        while ((long)(_due - micros()) > 0);
+
+        unsigned long drift = micros() - _due;
+        if (inject(f)) {
+            _sent++;
+            _driftSum += drift;
+            if (drift > _driftMax) _driftMax = drift;
+        }
+        else _dropped++;
+
+        if (_loop) {
+            if (++_played >= _count) _played = 0;
+        }
+        else {
+            _first = (_first + 1) % REPLAY_BUFFER_SIZE;
+            _count--;
+        }
+
+        f = nextFrame();
+        if (f == NULL) break;
+        _due += scaled(f->delta);
+    }
+
+    // Buffer drained, wait for the host to append more frames
+    _starved = true;
+}
+
+// False when the frame was dropped
+bool FrameReplay::inject(struct replay_frame *f)
+{
+    Message msg;
+    msg.busStatus = 0;
+    msg.busId = (_target == 0 || _target == REPLAY_TO_PIPELINE)? f->busId : _target;
+    msg.frame_id = f->frame_id;
+    msg.length = f->length;
+    memcpy(msg.frame_data, f->data, 8);
+    if (msg.busId < 1 || msg.busId > 3 || msg.length > 8) return false;
+
+    if (_target == REPLAY_TO_PIPELINE) {
+        // Accounted like a received frame, the loop releases it from the scheduler
+        msg.dispatch = false;
+        if (!_readQueue->canPush(false) || !busScheduler.admit(msg.busId - 1)) return false;
+        _readQueue->push(msg, false);
+        busScheduler.queued(msg.busId - 1);
+        return true;
+    }
+    msg.dispatch = true;
+    return _writeQueue->push(msg);
+}
+
+// False for a loop that takes no time, it would inject frames as fast as the loop runs
+bool FrameReplay::start(byte target, byte flags, unsigned int speed)
+{
+    _speed = (speed == 0)? 0x100 : speed;
+    _loop = (flags & 0x01) != 0;
+    if (_loop && _count > 0) {
+        unsigned long period = 0;
+        for (byte i = 0; i < _count && period == 0; i++)
+            period += scaled(_frames[(_first + i) % REPLAY_BUFFER_SIZE].delta);
+        if (period == 0) {
+            _playing = _loop = false;
+            return false;
+        }
+    }
+    _target = target;
+    _played = 0;
+    _sent = _dropped = _underruns = 0;
+    _driftMax = _driftSum = 0;
+    _playing = true;
+    _starved = (_count == 0);
+    if (!_starved) _due = micros() + scaled(_frames[_first].delta);
+    return true;
+}
+
+bool FrameReplay::append(Stream* serial)
+{
+    byte n;
+    if (readSerialBytes(serial, &n, 1) != 1) return false;
+
+    byte rec[REPLAY_RECORD_SIZE];
+    for (byte i = 0; i < n; i++) {
+        if (readSerialBytes(serial, rec, REPLAY_RECORD_SIZE) != REPLAY_RECORD_SIZE) return false;
+        if (_count >= REPLAY_BUFFER_SIZE) continue; // Host overran the free count
+
+        struct replay_frame *f = &_frames[(_first + _count) % REPLAY_BUFFER_SIZE];
+        f->delta = ((unsigned long)rec[0] << 24) | ((unsigned long)rec[1] << 16) | ((unsigned long)rec[2] << 8) | rec[3];
+        f->busId = rec[4];
+        f->frame_id = (rec[5] << 8) + rec[6];
+        f->length = rec[7];
+        memcpy(f->data, rec + 8, 8);
+        _count++;
+
+        if (_starved && _playing) {
+            if (_sent + _dropped > 0) _underruns++;
+            _starved = false;
+            _due = micros() + scaled(f->delta);
+        }
+    }
+    return true;
+}
+
+void FrameReplay::commandHandler(byte* bytes, int length, Stream* activeSerial)
+{
+    if (length == 0) {
+        activeSerial->write(COMMAND_ERROR);
+        return;
+    }
+
+    byte cmd[4];
+    switch(bytes[0]) {
+        case 0x01:
+            if (!append(activeSerial)) {
+                activeSerial->write(COMMAND_ERROR);
+                return;
+            }
+            activeSerial->print( F("{\"event\":\"replay\", \"free\":") );
+            activeSerial->print(REPLAY_BUFFER_SIZE - _count);
+            activeSerial->println( F("}") );
+            return;
+        case 0x02:
+            if (readSerialBytes(activeSerial, cmd, 4) != 4) {
+                activeSerial->write(COMMAND_ERROR);
+                return;
+            }
+            if (!start(cmd[0], cmd[1], (cmd[2] << 8) + cmd[3])) {
+                activeSerial->write(COMMAND_ERROR);
+                return;
+            }
+            break;
+        case 0x03:
+            _playing = false;
+            break;
+        case 0x04:
+            printStatus(activeSerial);
+            return;
+        case 0x05:
+            _playing = false;
+            _first = _count = _played = 0;
+            break;
+        default:
+            activeSerial->write(COMMAND_ERROR);
+            return;
+    }
+    activeSerial->write(COMMAND_OK);
+    activeSerial->write(NEWLINE);
+}
+
+void FrameReplay::printStatus(Stream* serial)
+{
+    serial->print( F("{\"event\":\"replay\", \"playing\":") );
+    serial->print(_playing? 1 : 0);
+    serial->print( F(", \"free\":") );
+    serial->print(REPLAY_BUFFER_SIZE - _count);
+    serial->print( F(", \"sent\":") );
+    serial->print(_sent);
+    serial->print( F(", \"dropped\":") );
+    serial->print(_dropped);
+    serial->print( F(", \"underruns\":") );
+    serial->print(_underruns);
+    serial->print( F(", \"driftMax\":") );
+    serial->print(_driftMax);
+    serial->print( F(", \"driftAvg\":") );
+    serial->print((_sent > 0)? _driftSum / _sent : 0L);
+    serial->println( F("}") );
+}
+
+#endif // FrameReplay_H
@@ -0,0 +1,51 @@
+#ifndef LedBlink_H
+#define LedBlink_H
+
+#include <CANBus.h>
+#include "Middleware.h"
+
+/*
+*  Non blocking LED blinking, run from the middleware ticks
+*/
+
+class LedBlink : public Middleware
+{
+public:
+    LedBlink(byte pin);
+    void start(byte count, unsigned int periodMs);
+    void tick();
+
+private:
+    byte _pin;
+    byte _toggles;        // Left to do, the LED is on while odd
+    unsigned int _halfPeriod;
+    unsigned long _nextMs;
+};
+
+LedBlink bootBlink(BOOT_LED);
+
+
+LedBlink::LedBlink(byte pin) : _pin(pin), _toggles(0), _halfPeriod(0), _nextMs(0)
+{
+}
+
+
+void LedBlink::start(byte count, unsigned int periodMs)
+{
+    pinMode(_pin, OUTPUT);
+    digitalWrite(_pin, HIGH);
+    _toggles = count * 2 - 1;
+    _halfPeriod = periodMs / 2;
+    _nextMs = millis() + _halfPeriod;
+}
+
+
+void LedBlink::tick()
+{
+    if (_toggles == 0 || (long)(millis() - _nextMs) < 0) return;
+    _toggles--;
+    digitalWrite(_pin, (_toggles & 1)? HIGH : LOW);
+    _nextMs += _halfPeriod;
+}
+
+#endif // LedBlink_H
@@ -0,0 +1,144 @@
+#ifndef LogEncoder_H
+#define LogEncoder_H
+
+#include <MessageQueue.h>
+
+/*
+*  Delta log records
+*
+*  Key:   0x12 BUS<<6|IDH IDL STATUS<<4|LEN D0..D(LEN-1) CHK
+*  Delta: 0x13 BUS<<6|IDH IDL MASK D(i) for each bit i of MASK CHK
+*
+*  A delta carries the bytes that changed since the last record sent for the same bus
+*  and id, LEN and STATUS are the ones of that record. CHK is the complement of the
+*  byte sum of the header and of the whole resulting payload, so a decoder that missed
+*  a record notices it on the next delta and waits for a key. Keys are sent for a new
+*  id, when LEN or STATUS change and every LOG_KEY_INTERVAL records of an id.
+*  tools/cbtlog decodes both these and the plain 0x03 records.
+*/
+
+#define LOG_RECORD_KEY 0x12
+#define LOG_RECORD_DELTA 0x13
+#define LOG_RECORD_SIZE_MAX 14
+#define LOG_DELTA_SLOTS 8       // Ids remembered, a power of 2, colliding ids send keys
+#define LOG_KEY_INTERVAL 32
+
+struct log_reference {
+    unsigned short key;   // bus << 11 | id, 0 = unused
+    byte info;            // STATUS << 4 | LEN as in the key record
+    byte sinceKey;
+    byte data[8];
+};
+
+class LogEncoder
+{
+  public:
+    LogEncoder();
+    bool delta() { return _delta; }
+    void setDelta(bool on);
+    byte recordSize(const Message &msg, Stream *serial);
+    void write(const Message &msg, Stream *serial);
+
+  private:
+    bool _delta;
+    Stream *_serial;      // Stream the references were sent to
+    struct log_reference _refs[LOG_DELTA_SLOTS];
+
+    void reset();
+    struct log_reference* reference(const Message &msg, bool &key, byte &mask);
+};
+
+
+LogEncoder::LogEncoder() : _delta(false), _serial(0)
+{
+    reset();
+}
+
+
+void LogEncoder::setDelta(bool on)
+{
+    _delta = on;
+    reset();
+}
+
+
+void LogEncoder::reset()
+{
+    for (byte i = 0; i < LOG_DELTA_SLOTS; i++) _refs[i].key = 0;
+}
+
+
+// Slot of msg's id, whether it needs a key and else the mask of changed bytes
+struct log_reference* LogEncoder::reference(const Message &msg, bool &key, byte &mask)
+{
+    unsigned short k = ((unsigned short)msg.busId << 11) | (msg.frame_id & 0x7FF);
+    // No collisions between the ids Mazda3CAN decodes
+    struct log_reference *ref = &_refs[(msg.frame_id ^ (msg.frame_id >> 4) ^ (msg.busId << 2)) & (LOG_DELTA_SLOTS - 1)];
+    byte length = (msg.length > 8)? 8 : msg.length;
+    byte info = ((msg.busStatus & 0x03) << 4) | length;
+
+    mask = 0;
+    key = ref->key != k || ref->info != info || ref->sinceKey >= LOG_KEY_INTERVAL;
+    if (!key)
+        for (byte i = 0; i < length; i++)
+            if (msg.frame_data[i] != ref->data[i]) mask |= 1 << i;
+    return ref;
+}
+
+
+// Bytes write() would send for msg to serial now
+byte LogEncoder::recordSize(const Message &msg, Stream *serial)
+{
+    bool key;
+    byte mask;
+    reference(msg, key, mask);
+    // write() forgets the references when the port changes, so it sends a key
+    if (key || serial != _serial) return 5 + ((msg.length > 8)? 8 : msg.length);
+
+    byte n = 5;
+    for (; mask; mask >>= 1) n += mask & 1;
+    return n;
+}
+
+
+void LogEncoder::write(const Message &msg, Stream *serial)
+{
+    if (serial != _serial) {
+        // A new listener has none of the references
+        reset();
+        _serial = serial;
+    }
+
+    bool key;
+    byte mask;
+    struct log_reference *ref = reference(msg, key, mask);
+    byte length = (msg.length > 8)? 8 : msg.length;
+    byte record[LOG_RECORD_SIZE_MAX];
+    byte n = 0;
+
+    record[n++] = key? LOG_RECORD_KEY : LOG_RECORD_DELTA;
+    record[n++] = (msg.busId << 6) | ((msg.frame_id >> 8) & 0x07);
+    record[n++] = msg.frame_id;
+    if (key) {
+        ref->key = ((unsigned short)msg.busId << 11) | (msg.frame_id & 0x7FF);
+        ref->info = ((msg.busStatus & 0x03) << 4) | length;
+        ref->sinceKey = 0;
+        record[n++] = ref->info;
+        for (byte i = 0; i < length; i++) record[n++] = msg.frame_data[i];
+    } else {
+        ref->sinceKey++;
+        record[n++] = mask;
+        for (byte i = 0; i < length; i++)
+            if (mask & (1 << i)) record[n++] = msg.frame_data[i];
+    }
+
+    byte sum = record[0] + record[1] + record[2] + record[3];
+    for (byte i = 0; i < length; i++) {
+        ref->data[i] = msg.frame_data[i];
+        sum += msg.frame_data[i];
+    }
+    record[n++] = ~sum;
+    serial->write(record, n);
+}
+
+#endif // LogEncoder_H
@@ -0,0 +1,207 @@
+#ifndef LoopWatchdog_H
+#define LoopWatchdog_H
+
+#include <avr/wdt.h>
+#include <avr/interrupt.h>
+
+/*
+*  Watchdog with stall attribution
+*
+*  The watchdog runs in interrupt + reset mode: after WDT_TIMEOUT the interrupt saves
+*  the loop stage that was running into .noinit RAM, a second timeout resets the MCU.
+*  The record survives the reset and is reported once USB is connected after boot.
+*  The dog is only petted while it runs with WDT_TIMEOUT: a 1200 baud touch makes the
+*  USB core arm a short reset into the bootloader, and petting would cancel it.
+*/
+
+#define WDT_TIMEOUT WDTO_1S
+#define WDT_PRESCALER (_BV(WDP3) | _BV(WDP2) | _BV(WDP1) | _BV(WDP0))
+#define WDT_TIMEOUT_BITS (((WDT_TIMEOUT & 0x08)? _BV(WDP3) : 0) | (WDT_TIMEOUT & 0x07))
+#define LOOP_DEADLINE 100  // ms, loops slower than this are counted as deadline misses
+#define STALL_MAGIC 0xCB75
+
+#define STAGE_IDLE 0
+#define STAGE_TICK 1       // index: middleware
+#define STAGE_PROCESS 2    // index: middleware
+#define STAGE_READ_BUS 3   // index: bus id
+#define STAGE_SEND 4       // index: bus id
+
+struct stall_record {
+    unsigned int magic;
+    byte pending;        // Set by the watchdog interrupt, cleared once the loop runs again
+    byte resets;
+    byte stage;          // Last watchdog timeout
+    byte index;
+    unsigned long ms;
+    byte longestStage;   // Longest stall seen, including deadline misses
+    byte longestIndex;
+    unsigned long longestMs;
+    unsigned int deadlineMisses;
+};
+
+struct stall_record stallRecord __attribute__ ((section (".noinit")));
+byte stallWasReset; // Last reset was caused by the watchdog
+volatile byte loopStage;
+volatile byte loopStageIndex;
+volatile unsigned long loopStartMs;
+unsigned long stageStartMs;
+byte slowStage, slowStageIndex;
+unsigned long slowStageMs;
+
+
+class LoopWatchdog
+{
+  public:
+    static void begin();
+    static void resume();
+    static void stage(byte stage, byte index);
+    static void endLoop();
+    static bool pet();
+    static void report(Stream* serial);
+
+  private:
+    static void printStage(Stream* serial, byte stage);
+};
+
+
+ISR(WDT_vect)
+{
+    // First timeout: record the culprit, the next timeout resets the MCU
+    unsigned long ms = millis() - loopStartMs;
+    stallRecord.pending = 1;
+    if (stallRecord.resets < 0xFF) stallRecord.resets++;
+    stallRecord.stage = loopStage;
+    stallRecord.index = loopStageIndex;
+    stallRecord.ms = ms;
+    if (ms > stallRecord.longestMs) {
+        stallRecord.longestStage = loopStage;
+        stallRecord.longestIndex = loopStageIndex;
+        stallRecord.longestMs = ms;
+    }
+}
+
+
+void LoopWatchdog::begin()
+{
+    if (stallRecord.magic != STALL_MAGIC) {
+        // Power on, .noinit holds garbage
+        memset(&stallRecord, 0, sizeof(stallRecord));
+        stallRecord.magic = STALL_MAGIC;
+    }
+    stallWasReset = stallRecord.pending;
+    stallRecord.pending = 0;
+
+    loopStage = STAGE_IDLE;
+    loopStartMs = stageStartMs = millis();
+    slowStageMs = 0;
+
+    wdt_enable(WDT_TIMEOUT);
+    WDTCSR |= _BV(WDIE); // Interrupt before reset
+}
+
+
+// Restart after the watchdog was disabled, e.g. to power down
+void LoopWatchdog::resume()
+{
+    loopStartMs = stageStartMs = millis();
+    wdt_enable(WDT_TIMEOUT);
+    WDTCSR |= _BV(WDIE);
+}
+
+
+void LoopWatchdog::stage(byte stage, byte index)
+{
+    unsigned long now = millis();
+    if (now - stageStartMs > slowStageMs) {
+        slowStageMs = now - stageStartMs;
+        slowStage = loopStage;
+        slowStageIndex = loopStageIndex;
+    }
+    stageStartMs = now;
+    loopStage = stage;
+    loopStageIndex = index;
+}
+
+
+// Reset the watchdog, false if it was disabled or armed with another timeout
+bool LoopWatchdog::pet()
+{
+    if ((WDTCSR & (WDT_PRESCALER | _BV(WDE))) != (WDT_TIMEOUT_BITS | _BV(WDE))) return false;
+    wdt_reset();
+    return true;
+}
+
+
+void LoopWatchdog::endLoop()
+{
+    stage(STAGE_IDLE, 0);
+
+    if (pet()) {
+        if (stallRecord.pending) {
+            // Recovered after the watchdog interrupt but before the reset
+            stallRecord.pending = 0;
+            if (stallRecord.resets > 0) stallRecord.resets--;
+        }
+        WDTCSR |= _BV(WDIE);
+    }
+
+    unsigned long now = millis();
+    if (now - loopStartMs > LOOP_DEADLINE) {
+        stallRecord.deadlineMisses++;
+        if (slowStageMs > stallRecord.longestMs) {
+            stallRecord.longestStage = slowStage;
+            stallRecord.longestIndex = slowStageIndex;
+            stallRecord.longestMs = slowStageMs;
+        }
+    }
+    loopStartMs = stageStartMs = now;
+    slowStageMs = 0;
+}
+
+
+void LoopWatchdog::report(Stream* serial)
+{
+    serial->print( F("{\"event\":\"stall\", \"reset\":") );
+    serial->print(stallWasReset);
+    serial->print( F(", \"resets\":") );
+    serial->print(stallRecord.resets);
+    serial->print( F(", \"stage\":\"") );
+    printStage(serial, stallRecord.stage);
+    serial->print( F("\", \"index\":") );
+    serial->print(stallRecord.index);
+    serial->print( F(", \"ms\":") );
+    serial->print(stallRecord.ms);
+    serial->print( F(", \"longestStage\":\"") );
+    printStage(serial, stallRecord.longestStage);
+    serial->print( F("\", \"longestIndex\":") );
+    serial->print(stallRecord.longestIndex);
+    serial->print( F(", \"longestMs\":") );
+    serial->print(stallRecord.longestMs);
+    serial->print( F(", \"deadlineMisses\":") );
+    serial->print(stallRecord.deadlineMisses);
+    serial->println( F("}") );
+}
+
+
+void LoopWatchdog::printStage(Stream* serial, byte stage)
+{
+    switch(stage) {
+        case STAGE_TICK:
+            serial->print( F("tick") );
+            break;
+        case STAGE_PROCESS:
+            serial->print( F("process") );
+            break;
+        case STAGE_READ_BUS:
+            serial->print( F("readBus") );
+            break;
+        case STAGE_SEND:
+            serial->print( F("sendMessage") );
+            break;
+        default:
+            serial->print( F("idle") );
+            break;
+    }
+}
+
+#endif // LoopWatchdog_H
@@ -4,6 +4,30 @@
 #include <MessageQueue.h>
 #include "Middleware.h"
 
+// Signals decoded by Mazda3CAN, each listener collects the ones that changed
+#define SIG_RPM        0x0001
+#define SIG_SPEED      0x0002
+#define SIG_GEAR       0x0004
+#define SIG_ENG_TEMP   0x0008
+#define SIG_DASHBOARD  0x0010
+#define SIG_DISTANCE   0x0020
+#define SIG_FUEL       0x0040
+#define SIG_FUEL_LEVEL 0x0080
+#define SIG_INT_TEMP   0x0100
+#define SIG_STEERING   0x0200
+
+// Signal ids, bit n of the change mask, engine shares the dashboard bit
+#define SIGNAL_ENGINE  10
+#define MAZDA_SIGNALS  11
+
+#define MAZDA_LAST_BUS 2  // The car is on busses 1 and 2, frames of bus 3 aren't decoded
+
+#define LISTENER_LCD 0
+#define LISTENER_RULES 1
+#define LISTENER_STATS 2
+#define LISTENER_FEED 3
+#define MAZDA_LISTENERS 4
+
 class Mazda3CAN : public Middleware
 {
 public:
@@ -26,6 +50,9 @@ public:
     void tick();
     Message process(Message msg );
     void commandHandler(byte* bytes, int length, Stream* activeSerial);
+    unsigned int takeChanges(byte listener);
+    long signal(byte id);
+    static unsigned int signalBit(byte id) { return (id == SIGNAL_ENGINE)? SIG_DASHBOARD : 1 << id; }
 
     char * getEngineTemp();
     char * getInternalTemp();    
@@ -40,7 +67,9 @@ private:
     byte _fuel;
     byte _engineDashboard;
     unsigned long _nextLogTst;
+    unsigned int _changes[MAZDA_LISTENERS];
 
+    void changed(unsigned int signals);
     void updateEngineDashboard(byte status);
     byte decodeGear(const Message msg);
 };
@@ -52,6 +81,42 @@ Mazda3CAN::Mazda3CAN() :
 {
     _distance = _fuel = _engineDashboard = 0;
     _nextLogTst = 0L; 
+    for (byte l = 0; l < MAZDA_LISTENERS; l++) _changes[l] = 0;
+}
+
+
+void Mazda3CAN::changed(unsigned int signals)
+{
+    for (byte l = 0; l < MAZDA_LISTENERS; l++) _changes[l] |= signals;
+}
+
+
+// Signals changed since the listener last asked
+unsigned int Mazda3CAN::takeChanges(byte listener)
+{
+    unsigned int c = _changes[listener];
+    _changes[listener] = 0;
+    return c;
+}
+
+
+// Value of a signal by id, in the units of its public member
+long Mazda3CAN::signal(byte id)
+{
+    switch (id) {
+        case 0: return rpm;
+        case 1: return speed;
+        case 2: return gear;
+        case 3: return engTemp;
+        case 4: return dashboardOn;
+        case 5: return distance;
+        case 6: return fuel;
+        case 7: return fuelLevel;
+        case 8: return intTemp;
+        case 9: return steering;
+        case SIGNAL_ENGINE: return engineOn;
+    }
+    return 0;
 }
 
 
@@ -88,22 +153,33 @@ void Mazda3CAN::tick()
 
 Message Mazda3CAN::process(Message msg)
 {
+    int newRpm, newSpeed, angle;
+    byte b;
+
+    if (msg.busId > MAZDA_LAST_BUS) return msg;
     switch(msg.frame_id) {
         case 0x201: // RPM and vehicle speed
             if ((msg.frame_data[0] & 0x80) > 0) {
                 // Dashboard OFF
-                rpm = speed = 0;
+                newRpm = newSpeed = 0;
             } else {
-                rpm = (((int)msg.frame_data[0] << 8) + msg.frame_data[1]) & 0x7FFF;
-                speed = (((int)msg.frame_data[4] << 8) + msg.frame_data[5]) & 0x7FFF;
+                newRpm = (((int)msg.frame_data[0] << 8) + msg.frame_data[1]) & 0x7FFF;
+                newSpeed = (((int)msg.frame_data[4] << 8) + msg.frame_data[5]) & 0x7FFF;
             }
+            if (newRpm != rpm) changed(SIG_RPM);
+            if (newSpeed != speed) changed(SIG_SPEED);
+            rpm = newRpm;
+            speed = newSpeed;
             break;
 
         case 0x231:
-            gear = decodeGear(msg);
+            b = decodeGear(msg);
+            if (b != gear) changed(SIG_GEAR);
+            gear = b;
             break;
 
         case 0x420: // Engine temperature, distance, fuel and dashboard
+            if (msg.frame_data[0] != engTemp) changed(SIG_ENG_TEMP);
             engTemp = msg.frame_data[0];
                         
             if (msg.frame_data[5] != _engineDashboard) updateEngineDashboard(msg.frame_data[5]);
@@ -113,6 +189,7 @@ Message Mazda3CAN::process(Message msg)
                 distance += (unsigned long)diff;
                 if (gear == 0xE) mov -= diff; else mov += diff;
                 _distance = msg.frame_data[1];
+                changed(SIG_DISTANCE);
             }
 
             if (msg.frame_data[2] != _fuel) {
@@ -122,21 +199,26 @@ Message Mazda3CAN::process(Message msg)
                 } else {
                     fuel += (unsigned long)(msg.frame_data[2] + ((msg.frame_data[2] < _fuel)? 256 : 0) - _fuel);
                     _fuel = msg.frame_data[2];                    
+                    changed(SIG_FUEL);
                 }
             }        
             break;
 
         case 0x430:
+            if (msg.frame_data[0] != fuelLevel) changed(SIG_FUEL_LEVEL);
             fuelLevel = msg.frame_data[0];
             break;
 
         case 0x433:
+            if (msg.frame_data[2] != intTemp) changed(SIG_INT_TEMP);
             intTemp = msg.frame_data[2];
             break;
 
         case 0x4DA: // Steering angle
             // TODO: save offset value in EEPROM
-            steering = (msg.frame_data[0] == 0xFF)? 0 : ((int)msg.frame_data[0] << 8) + (int)msg.frame_data[1] - 32768;
+            angle = (msg.frame_data[0] == 0xFF)? 0 : ((int)msg.frame_data[0] << 8) + (int)msg.frame_data[1] - 32768;
+            if (angle != steering) changed(SIG_STEERING);
+            steering = angle;
             break;
     }
     return msg;
@@ -196,6 +278,7 @@ void Mazda3CAN::updateEngineDashboard(byte status)
             break;
     }
     _engineDashboard = status;
+    changed(SIG_DASHBOARD);
 }
 
 
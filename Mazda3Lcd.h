@@ -2,20 +2,39 @@
 #define Mazda3Lcd_H
 
 #include <EEPROM.h>
+#include <avr/pgmspace.h>
 #include <MessageQueue.h>
+#include "MessageRing.h"
 #include "Middleware.h"
 #include "Mazda3CAN.h"
+#include "TripComputer.h"
+#include "SignalStats.h"
 #include "Settings.h"
 
 #define LCD_BUS_ID 2
-#define N_DISPLAY_MODES 7
+#define LCD_KEEPALIVE 250 // ms, the dashboard needs the frames repeated even if the text didn't change
+
+class Mazda3Lcd;
+
+/*
+*  Display mode renderer: the signals its text depends on and how often it may run.
+*  A mode is re-rendered when a dependency changed and minInterval has passed,
+*  or anyway after maxInterval (for values that change with time, like averages).
+*/
+struct display_renderer {
+    void (Mazda3Lcd::*render)();
+    unsigned int deps;         // SIG_* of Mazda3CAN
+    unsigned int minInterval;  // ms
+    unsigned int maxInterval;  // ms
+};
+
 class Mazda3Lcd : public Middleware
 {	
 public:
     bool buttonInfo;
     bool buttonClock;
 
-    Mazda3Lcd(Mazda3CAN *mazda_can, MessageQueue *writeQueue);
+    Mazda3Lcd(Mazda3CAN *mazda_can, TripComputer *trip, SignalStats *stats, MessageRing *writeQueue);
     void init(byte displayMode);
     void tick();
     void commandHandler(byte* bytes, int length, Stream* activeSerial);
@@ -26,49 +45,122 @@ public:
     void showMessage(const char * msg, const int msec);
 
 private:
-	unsigned long _nextDisplayTst;
+    static const struct display_renderer _renderers[];
+    static const byte _nRenderers;
+
+    unsigned long _lastRenderTst;
+    unsigned long _lastSendTst;
     unsigned long _msgDisplayTst;
+    bool _renderNeeded; // Mode changed or a message ended
+    bool _sendNeeded;   // Button state changed
+    unsigned int _changes;
 	char _lcdText[13];
     byte _canBuf[8];
     byte _displayMode;
     byte _lcdSymbols; // Byte 3 of msg 0x28F
     byte _lcdButtons; // Byte 5 of msg 0x28F        
 	Mazda3CAN* _mazda;
-	MessageQueue* _writeQueue;
-
-    void generateLCDText();
+	TripComputer* _trip;
+	SignalStats* _stats;
+	MessageRing* _writeQueue;
+
+    void renderRpmBar();
+    void renderTachometer();
+    void renderTemperatures();
+    void renderSteering();
+    void renderDistanceFuel();
+    void renderFuelLevel();
+    void renderInstantConsumption();
+    void renderAverageConsumption();
+    void renderWindowConsumption();
+    void renderKmPerLitre();
+    void renderAverageSpeed();
+    void renderFuelUsed();
+    void renderMaxRpm();
+    void renderSpeedStats();
+    void renderEngineTempRange();
+    void sendText();
+    void formatDecimal(const char * label, long value);
     void pushMessage(const unsigned short msgId);
     char formatGear(const byte gear);
     void setDisplayMode(byte displayMode);
 };
 
-Mazda3Lcd::Mazda3Lcd(Mazda3CAN *mazda_can, MessageQueue *writeQueue) 
+// Display modes in order, mode 0 leaves the dashboard text alone
+const struct display_renderer Mazda3Lcd::_renderers[] PROGMEM = {
+    { 0,                                    0,                              0,    0 },
+    { &Mazda3Lcd::renderRpmBar,             SIG_RPM | SIG_SPEED | SIG_GEAR, 50,   1000 },
+    { &Mazda3Lcd::renderTachometer,         SIG_RPM | SIG_SPEED | SIG_GEAR, 100,  1000 },
+    { &Mazda3Lcd::renderTemperatures,       SIG_ENG_TEMP | SIG_INT_TEMP,    500,  5000 },
+    { &Mazda3Lcd::renderSteering,           SIG_STEERING | SIG_DISTANCE,    100,  2000 },
+    { &Mazda3Lcd::renderDistanceFuel,       SIG_DISTANCE | SIG_FUEL,        250,  2000 },
+    { &Mazda3Lcd::renderFuelLevel,          SIG_FUEL_LEVEL,                 2000, 10000 },
+    { &Mazda3Lcd::renderInstantConsumption, SIG_SPEED | SIG_FUEL,           250,  1000 },
+    { &Mazda3Lcd::renderAverageConsumption, SIG_DISTANCE | SIG_FUEL,        1000, 5000 },
+    { &Mazda3Lcd::renderWindowConsumption,  SIG_DISTANCE | SIG_FUEL,        1000, 2000 },
+    { &Mazda3Lcd::renderKmPerLitre,         SIG_DISTANCE | SIG_FUEL,        1000, 5000 },
+    { &Mazda3Lcd::renderAverageSpeed,       SIG_SPEED,                      1000, 5000 },
+    { &Mazda3Lcd::renderFuelUsed,           SIG_FUEL,                       1000, 5000 },
+    { &Mazda3Lcd::renderMaxRpm,             SIG_RPM,                        250,  1000 },
+    { &Mazda3Lcd::renderSpeedStats,         SIG_SPEED,                      500,  2000 },
+    { &Mazda3Lcd::renderEngineTempRange,    SIG_ENG_TEMP,                   1000, 5000 },
+};
+const byte Mazda3Lcd::_nRenderers = sizeof(_renderers) / sizeof(_renderers[0]);
+
+Mazda3Lcd::Mazda3Lcd(Mazda3CAN *mazda_can, TripComputer *trip, SignalStats *stats, MessageRing *writeQueue) 
 	: buttonInfo(false), buttonClock(false), _displayMode(0), _lcdSymbols(0), _lcdButtons(0x20)
 {
 	_mazda = mazda_can;
+	_trip = trip;
+	_stats = stats;
 	_writeQueue = writeQueue;
 }
 
 void Mazda3Lcd::init(byte displayMode)
 {
-    _nextDisplayTst = _msgDisplayTst = 0;
+    _lastRenderTst = _lastSendTst = _msgDisplayTst = 0;
+    _renderNeeded = true;
+    _sendNeeded = false;
+    _changes = 0;
     _lcdText[0] = 0x00;
-    _displayMode = displayMode;
+    _displayMode = (displayMode < _nRenderers)? displayMode : 0;
 }
 
 void Mazda3Lcd::tick()
 {
+    _changes |= _mazda->takeChanges(LISTENER_LCD);
     if (!_mazda->dashboardOn) return;
     unsigned long tst = millis();
+    bool showingMessage = tst < _msgDisplayTst;
 
-	if (tst < _nextDisplayTst || (_displayMode == 0 && tst > _msgDisplayTst)) return;
-    _nextDisplayTst = tst + 250L;
+	if (_displayMode == 0 && !showingMessage) return;
 
-    if (tst < _msgDisplayTst) // Showing message
+    bool send = _sendNeeded || tst - _lastSendTst >= LCD_KEEPALIVE;
+    if (showingMessage) {
         _lcdSymbols = 0;
-    else
-        generateLCDText();
-    
+    }
+    else {
+        struct display_renderer r;
+        memcpy_P(&r, &_renderers[_displayMode], sizeof(r));
+        unsigned long age = tst - _lastRenderTst;
+        if (_renderNeeded || age >= r.maxInterval || ((_changes & r.deps) && age >= r.minInterval)) {
+            _lcdSymbols = 0;
+            (this->*r.render)();
+            _lastRenderTst = tst;
+            _renderNeeded = false;
+            _changes = 0;
+            send = true;
+        }
+    }
+    if (!send) return;
+
+    _lastSendTst = tst;
+    _sendNeeded = false;
+    sendText();
+}
+
+void Mazda3Lcd::sendText()
+{
     _canBuf[0] = 0x80;
     memset((_canBuf + 1), 0, 7);
     _canBuf[3] = _lcdSymbols;
@@ -106,7 +198,11 @@ void Mazda3Lcd::commandHandler(byte* bytes, int length, Stream* activeSerial)
     if (bytes[0] > 0x3F) {
         // I primi due bit più significativi corrispondono ai pulsanti Clock e Info
         _lcdButtons |= (bytes[0] >> 3);
-        _nextDisplayTst = 0; // Forza l'aggiornamento del display
+        _sendNeeded = true; // Forza l'aggiornamento del display
+    }
+	else if (bytes[0] >= _nRenderers) {
+        activeSerial->write(COMMAND_ERROR);
+        return;
     }
 	else if (bytes[0] != _displayMode) {
         // Gli altri bit corrispondono alla modalità di visualizzazione
@@ -116,93 +212,168 @@ void Mazda3Lcd::commandHandler(byte* bytes, int length, Stream* activeSerial)
     activeSerial->write(NEWLINE);    
 }
 
-void Mazda3Lcd::generateLCDText() 
+// Barra RPM, marcia, velocità
+void Mazda3Lcd::renderRpmBar()
+{
+	// Barra RPM
+	_lcdText[0] = (_mazda->rpm > 800)?  0xBA : (_mazda->rpm > 600)?  ']' : '_';
+	_lcdText[1] = (_mazda->rpm > 1200)? 0xBA : (_mazda->rpm > 1000)? ']' : '_';
+	_lcdText[2] = (_mazda->rpm > 1600)? 0xBA : (_mazda->rpm > 1400)? ']' : '_';
+	_lcdText[3] = (_mazda->rpm > 2000)? 0xBA : (_mazda->rpm > 1800)? ']' : '_';
+	_lcdText[4] = (_mazda->rpm > 2400)? 0xBA : (_mazda->rpm > 2200)? ']' : '_';
+	_lcdText[5] = (_mazda->rpm > 2800)? 0xBA : (_mazda->rpm > 2600)? ']' : '_';
+	_lcdText[6] = (_mazda->rpm > 3000)? ']' : ' ';
+	// Marcia
+	_lcdText[7] = formatGear(_mazda->gear);
+	// Velocità
+	dtostrf((float)_mazda->speed / 100.0, 4, 0, _lcdText + 8);
+}
+
+// Tachimetro
+void Mazda3Lcd::renderTachometer()
+{
+	sprintf(_lcdText, "%5d", _mazda->rpm);
+	_lcdText[5] = _lcdText[6] = ' ';
+	// Marcia
+	_lcdText[7] = formatGear(_mazda->gear);
+	// Velocità
+	dtostrf((float)_mazda->speed / 100.0, 4, 0, _lcdText + 8);
+}
+
+// T. motore e T. interna
+void Mazda3Lcd::renderTemperatures()
 {
     char* buf;
 
-	switch(_displayMode) {
-		case 1: // Barra RPM, marcia, velocità
-			// Barra RPM
-			_lcdText[0] = (_mazda->rpm > 800)?  0xBA : (_mazda->rpm > 600)?  ']' : '_';
-			_lcdText[1] = (_mazda->rpm > 1200)? 0xBA : (_mazda->rpm > 1000)? ']' : '_';
-			_lcdText[2] = (_mazda->rpm > 1600)? 0xBA : (_mazda->rpm > 1400)? ']' : '_';
-			_lcdText[3] = (_mazda->rpm > 2000)? 0xBA : (_mazda->rpm > 1800)? ']' : '_';
-			_lcdText[4] = (_mazda->rpm > 2400)? 0xBA : (_mazda->rpm > 2200)? ']' : '_';
-			_lcdText[5] = (_mazda->rpm > 2800)? 0xBA : (_mazda->rpm > 2600)? ']' : '_';
-			_lcdText[6] = (_mazda->rpm > 3000)? ']' : ' ';
-			// Marcia
-			_lcdText[7] = formatGear(_mazda->gear);
-			// Velocità
-			dtostrf((float)_mazda->speed / 100.0, 4, 0, _lcdText + 8);
-			break;
-
-		case 2: // Tachimetro
-			sprintf(_lcdText, "%5d", _mazda->rpm);
-			_lcdText[5] = _lcdText[6] = ' ';
-			// Marcia
-			_lcdText[7] = formatGear(_mazda->gear);
-			// Velocità
-			dtostrf((float)_mazda->speed / 100.0, 4, 0, _lcdText + 8);
-			break;
-
-		case 3: // T. motore e T. interna
-            strcpy(_lcdText, "Tm    Ti");
-            buf = _mazda->getEngineTemp();
-            _lcdText[2] = buf[0];
-            _lcdText[3] = buf[1];
-            _lcdText[4] = buf[2];
-            
-            buf = _mazda->getInternalTemp();
-            _lcdText[8] = buf[0];
-            _lcdText[9] = buf[1];
-            _lcdText[10] = buf[2];
-            _lcdText[11] = buf[4];
-
-            _lcdSymbols = 0x04; // Simbolo '.' tra 11° e 12° carattere
-			break;
-
-        case 4: // Volante e spostamento
-            sprintf(_lcdText, "%5d", _mazda->steering);
-            _lcdText[5] = _lcdText[6] = _lcdText[7] = ' ';
-
-            buf = _mazda->getMovement();
-            _lcdText[8] = buf[0];
-            _lcdText[9] = buf[1];
-            _lcdText[10] = buf[2];
-            _lcdText[11] = buf[4];
-
-            _lcdSymbols = 0x04; // Simbolo '.' tra 11° e 12° carattere
-            break;
-
-        case 5: // Distanza e carburante consumato
-            memcpy(_lcdText, _mazda->getDistance(), 7);
-            buf = _mazda->getFuel();
-            for(int b = 0; b < 5; b++) _lcdText[7 + b] = buf[b];
-            break;
-
-        case 6: // Livello carburante
-            strcpy(_lcdText, "Liv car    l");
-            buf = _mazda->getFuelLevel();
-            _lcdText[8] = buf[0];
-            _lcdText[9] = buf[1];
-            _lcdText[10] = buf[3];
-            _lcdSymbols = 0x02; // Simbolo '.' tra 10° e 11° carattere
-            break;
-
-		default:
-			strcpy(_lcdText, "  Emanuele  ");
-	}
+    strcpy(_lcdText, "Tm    Ti");
+    buf = _mazda->getEngineTemp();
+    _lcdText[2] = buf[0];
+    _lcdText[3] = buf[1];
+    _lcdText[4] = buf[2];
+    
+    buf = _mazda->getInternalTemp();
+    _lcdText[8] = buf[0];
+    _lcdText[9] = buf[1];
+    _lcdText[10] = buf[2];
+    _lcdText[11] = buf[4];
+
+    _lcdSymbols = 0x04; // Simbolo '.' tra 11° e 12° carattere
+}
+
+// Volante e spostamento
+void Mazda3Lcd::renderSteering()
+{
+    char* buf;
+
+    sprintf(_lcdText, "%5d", _mazda->steering);
+    _lcdText[5] = _lcdText[6] = _lcdText[7] = ' ';
+
+    buf = _mazda->getMovement();
+    _lcdText[8] = buf[0];
+    _lcdText[9] = buf[1];
+    _lcdText[10] = buf[2];
+    _lcdText[11] = buf[4];
+
+    _lcdSymbols = 0x04; // Simbolo '.' tra 11° e 12° carattere
+}
+
+// Distanza e carburante consumato
+void Mazda3Lcd::renderDistanceFuel()
+{
+    memcpy(_lcdText, _mazda->getDistance(), 7);
+    char* buf = _mazda->getFuel();
+    for(int b = 0; b < 5; b++) _lcdText[7 + b] = buf[b];
+}
+
+// Livello carburante
+void Mazda3Lcd::renderFuelLevel()
+{
+    strcpy(_lcdText, "Liv car    l");
+    char* buf = _mazda->getFuelLevel();
+    _lcdText[8] = buf[0];
+    _lcdText[9] = buf[1];
+    _lcdText[10] = buf[3];
+    _lcdSymbols = 0x02; // Simbolo '.' tra 10° e 11° carattere
+}
+
+// Consumo istantaneo (l/100km)
+void Mazda3Lcd::renderInstantConsumption()
+{
+    formatDecimal("Cons ist    ", _trip->instantConsumption());
+}
+
+// Consumo medio del viaggio (l/100km)
+void Mazda3Lcd::renderAverageConsumption()
+{
+    formatDecimal("Cons med    ", _trip->averageConsumption());
+}
+
+// Consumo recente, finestra mobile (l/100km)
+void Mazda3Lcd::renderWindowConsumption()
+{
+    formatDecimal("Cons rec    ", _trip->windowConsumption());
+}
+
+// Km/l medi
+void Mazda3Lcd::renderKmPerLitre()
+{
+    formatDecimal("Km/l med    ", _trip->averageKmPerLitre());
+}
+
+// Velocità media
+void Mazda3Lcd::renderAverageSpeed()
+{
+    formatDecimal("Vel med     ", _trip->averageSpeed());
+}
+
+// Carburante consumato nel viaggio (l)
+void Mazda3Lcd::renderFuelUsed()
+{
+    formatDecimal("Carb us     ", _trip->fuelUsed());
+}
+
+// Giri massimi nella finestra delle statistiche
+void Mazda3Lcd::renderMaxRpm()
+{
+    snprintf(_lcdText, sizeof(_lcdText), "Giri max%4d", constrain(_stats->stat(STATS_RPM).windowMax(), 0, 9999));
+}
+
+// Velocità media e massima nella finestra delle statistiche
+void Mazda3Lcd::renderSpeedStats()
+{
+    RollingStat &st = _stats->stat(STATS_SPEED);
+    snprintf(_lcdText, sizeof(_lcdText), "Vm%4d Mx%3d", constrain(st.windowMean() / 100, 0, 999), constrain(st.windowMax() / 100, 0, 999));
+}
+
+// T. motore minima e massima dall'accensione
+void Mazda3Lcd::renderEngineTempRange()
+{
+    RollingStat &st = _stats->stat(STATS_ENG_TEMP);
+    // Same rounding as Mazda3CAN::getEngineTemp()
+    snprintf(_lcdText, sizeof(_lcdText), "Tm %3d -%3d ", constrain(st.sessionMin() / 4 + 4, -99, 999), constrain(st.sessionMax() / 4 + 4, -99, 999));
+}
+
+// Label and a value * 10 in the last 4 characters, with the decimal symbol
+void Mazda3Lcd::formatDecimal(const char * label, long value)
+{
+    strcpy(_lcdText, label);
+    if (value < 0 || value > 9999) {
+        _lcdText[10] = _lcdText[11] = '-';
+        _lcdSymbols = 0;
+        return;
+    }
+    sprintf(_lcdText + 8, "%4d", (int)value);
+    if (value < 10) _lcdText[10] = '0';
+    _lcdSymbols = 0x04; // Simbolo '.' tra 11° e 12° carattere
 }
 
 void Mazda3Lcd::pushMessage(const unsigned short msgId)
 {
-    Message msg;
-    msg.length = 8;
-    msg.frame_id = msgId;
-    memcpy(msg.frame_data, _canBuf, 8);
-    msg.busId = LCD_BUS_ID;
-	msg.dispatch = true;
-	_writeQueue->push(msg);
+    Frame *frame = _writeQueue->reserve();
+    if (frame == NULL) return; // Write queue full, drop it
+    frame->set(LCD_BUS_ID, msgId, 8, true);
+    memcpy(frame->data, _canBuf, 8);
+    _writeQueue->commit();
 }
 
 char Mazda3Lcd::formatGear(const byte gear) 
@@ -216,13 +387,13 @@ char Mazda3Lcd::formatGear(const byte gear)
 void Mazda3Lcd::pushInfo()
 {
     _lcdButtons |= 0x08; // Imposta il bit 4
-    _nextDisplayTst = 0; // Forza l'aggiornamento del display
+    _sendNeeded = true; // Forza l'aggiornamento del display
 }
 
 void Mazda3Lcd::pushClock()
 {
     _lcdButtons |= 0x10; // Imposta il bit 5
-    _nextDisplayTst = 0; // Forza l'aggiornamento del display
+    _sendNeeded = true; // Forza l'aggiornamento del display
 }
 
 void Mazda3Lcd::setDisplayMode(byte displayMode)
@@ -230,17 +401,18 @@ void Mazda3Lcd::setDisplayMode(byte displayMode)
     _msgDisplayTst = millis() + 1500;
     sprintf(_lcdText, "   Modo %d   ", displayMode);
     cbt_settings.displayIndex = _displayMode = displayMode;
+    _renderNeeded = _sendNeeded = true;
     EEPROM.write( offsetof(struct cbt_settings, displayIndex), _displayMode);
 }
 
 void Mazda3Lcd::nextDisplayMode()
 {
-    setDisplayMode((_displayMode + 1) % N_DISPLAY_MODES);
+    setDisplayMode((_displayMode + 1) % _nRenderers);
 }
 
 void Mazda3Lcd::prevDisplayMode()
 {    
-    if (_displayMode == 0) setDisplayMode(N_DISPLAY_MODES - 1);
+    if (_displayMode == 0) setDisplayMode(_nRenderers - 1);
     else setDisplayMode(_displayMode - 1);
 }
 
@@ -248,6 +420,7 @@ void Mazda3Lcd::showMessage(const char * msg, const int msec)
 {
     _msgDisplayTst = millis() + msec;
     strncpy(_lcdText, msg, 13);
+    _renderNeeded = _sendNeeded = true;
 }
 
 #endif // Mazda3Lcd_H
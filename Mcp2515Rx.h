@@ -0,0 +1,146 @@
+#ifndef Mcp2515Rx_H
+#define Mcp2515Rx_H
+
+#include <SPI.h>
+#include <CANBus.h>
+#include "Frame.h"
+
+/*
+*  MCP2515 receive fast path
+*
+*  RX STATUS tells which RX buffers are full and which filter matched in one byte.
+*  READ RX BUFFER streams the id and only DLC data bytes of a buffer straight from
+*  the buffer address and clears its RXnIF flag when chip select goes high, so a
+*  frame costs one transaction instead of a register read, a block read and a
+*  separate flag clear.
+*  The filter bits of RX STATUS belong to the last frame received, which isn't always
+*  the one left in RXB1, so rollover is told apart by the FILHIT bits of RXB1CTRL.
+*/
+
+#define MCP_RX_STATUS 0xB0
+#define MCP_READ_RX_BUFFER 0x90   // | bufferId << 2, starts at RXBnSIDH
+#define MCP_BIT_MODIFY 0x05
+#define MCP_READ 0x03
+#define MCP_RXB1CTRL 0x70
+
+#define RX_STATUS_RXB0 0x40
+#define RX_STATUS_RXB1 0x80
+#define RXB1CTRL_FILHIT 0x07
+#define RXB1_ROLLOVER 2           // FILHIT 0 / 1: RXF0 / RXF1 hit rolled over to RXB1
+
+class Mcp2515Rx
+{
+  public:
+    Mcp2515Rx(byte csPin);
+    byte rxStatus();
+    bool rolledOver();
+    void readFrame(byte bufferId, Frame *frame);
+    void discard(byte bufferId);
+    void printStats(Stream* serial);
+
+    unsigned long transactions;
+    unsigned long bytes;
+    unsigned long frames;
+
+  private:
+    byte _csPin;
+    volatile uint8_t *_csPort;
+    uint8_t _csMask;
+
+    void select();
+    void deselect() { *_csPort |= _csMask; }
+};
+
+Mcp2515Rx busRx[] = { Mcp2515Rx(CAN1SELECT), Mcp2515Rx(CAN2SELECT), Mcp2515Rx(CAN3SELECT) };
+
+
+Mcp2515Rx::Mcp2515Rx(byte csPin) : transactions(0), bytes(0), frames(0), _csPin(csPin), _csPort(0), _csMask(0)
+{
+}
+
+
+void Mcp2515Rx::select()
+{
+    // Port lookups aren't constant before main(), resolve them on first use
+    if (_csPort == 0) {
+        _csPort = portOutputRegister(digitalPinToPort(_csPin));
+        _csMask = digitalPinToBitMask(_csPin);
+    }
+    *_csPort &= ~_csMask;
+    transactions++;
+}
+
+
+// Bit 6 / 7: RXB0 / RXB1 full, bits 0-2: filter of the last received frame
+byte Mcp2515Rx::rxStatus()
+{
+    select();
+    SPI.transfer(MCP_RX_STATUS);
+    byte status = SPI.transfer(0);
+    deselect();
+    bytes += 2;
+    return status;
+}
+
+
+// The frame in RXB1 matched a RXB0 filter
+bool Mcp2515Rx::rolledOver()
+{
+    select();
+    SPI.transfer(MCP_READ);
+    SPI.transfer(MCP_RXB1CTRL);
+    byte ctrl = SPI.transfer(0);
+    deselect();
+    bytes += 3;
+    return (ctrl & RXB1CTRL_FILHIT) < RXB1_ROLLOVER;
+}
+
+
+// Fills id, DLC and data of frame, its bus, dispatch and status bits are kept
+void Mcp2515Rx::readFrame(byte bufferId, Frame *frame)
+{
+    select();
+    SPI.transfer(MCP_READ_RX_BUFFER | (bufferId << 2));
+    byte sidh = SPI.transfer(0);
+    byte sidl = SPI.transfer(0);
+    SPI.transfer(0); // EID8
+    SPI.transfer(0); // EID0
+    byte dlc = SPI.transfer(0) & 0x0F;
+    if (dlc > 8) dlc = 8;
+    for (byte i = 0; i < dlc; i++) frame->data[i] = SPI.transfer(0);
+    deselect();
+
+    for (byte i = dlc; i < 8; i++) frame->data[i] = 0;
+    frame->info = (frame->info & ~FRAME_LENGTH) | dlc;
+    frame->idHigh = (frame->idHigh & 0x18) | (sidh >> 5);
+    frame->idLow = (sidh << 3) | (sidl >> 5);
+    bytes += 6 + dlc;
+    frames++;
+}
+
+
+// Free a buffer without reading it by clearing its RXnIF flag
+void Mcp2515Rx::discard(byte bufferId)
+{
+    byte flag = 1 << bufferId;
+    select();
+    SPI.transfer(MCP_BIT_MODIFY);
+    SPI.transfer(CANINTF);
+    SPI.transfer(flag);
+    SPI.transfer(0);
+    deselect();
+    bytes += 4;
+}
+
+
+void Mcp2515Rx::printStats(Stream* serial)
+{
+    serial->print( F("\", \"rxFrames\":\"") );
+    serial->print( frames );
+    serial->print( F("\", \"spiTransactions\":\"") );
+    serial->print( transactions );
+    serial->print( F("\", \"spiBytes\":\"") );
+    serial->print( bytes );
+}
+
+#endif // Mcp2515Rx_H
@@ -0,0 +1,106 @@
+#ifndef MemoryMap_H
+#define MemoryMap_H
+
+#include "Settings.h"
+#include "ReadQueue.h"
+
+/*
+*  Stack high-water mark and memory map
+*
+*  Before the C runtime starts, the RAM from _end to the top of the stack is painted
+*  with STACK_CANARY. _end is past .noinit, which follows .bss, so the stall record
+*  kept there across resets isn't overwritten. The deepest stack use since boot is found by
+*  scanning up from the heap end for the first byte that was overwritten.
+*/
+
+#define STACK_CANARY 0xC5
+
+extern uint8_t __data_start, __data_end, __bss_start, __bss_end, __heap_start, _end;
+extern char *__brkval;
+
+// Runs from .init1, before the stack is used, so it can't be a regular function
+void paintStack(void) __attribute__ ((naked, used, section (".init1")));
+void paintStack(void)
+{
+    __asm volatile (
+        "    ldi r30, lo8(_end)   \n"
+        "    ldi r31, hi8(_end)   \n"
+        "    ldi r24, %0          \n"
+        "    ldi r25, hi8(__stack)\n"
+        "    rjmp 2f              \n"
+        "1:  st Z+, r24           \n"
+        "2:  cpi r30, lo8(__stack)\n"
+        "    cpc r31, r25         \n"
+        "    brlo 1b              \n"
+        "    breq 1b              \n"
+        :
+        : "i" (STACK_CANARY)
+    );
+}
+
+
+class MemoryMap
+{
+  public:
+    static int freeRam();
+    static unsigned int stackHighWater();
+    static int minFreeRam();
+    static void report(Stream* serial);
+
+  private:
+    static uint8_t* heapEnd() { return (__brkval == 0)? &__heap_start : (uint8_t*)__brkval; }
+    static void printField(Stream* serial, const __FlashStringHelper *name, unsigned int value);
+};
+
+
+// Current gap between the heap and the stack
+int MemoryMap::freeRam()
+{
+    uint8_t v;
+    return (int)&v - (int)heapEnd();
+}
+
+
+// Smallest gap between the heap and the stack since boot
+int MemoryMap::minFreeRam()
+{
+    uint8_t *p = heapEnd();
+    uint8_t *sp = (uint8_t*)SP;
+    while (p <= sp && *p == STACK_CANARY) p++;
+    return (int)(p - heapEnd());
+}
+
+
+// Deepest stack use since boot in bytes
+unsigned int MemoryMap::stackHighWater()
+{
+    return (unsigned int)(RAMEND - (int)heapEnd() + 1 - minFreeRam());
+}
+
+
+void MemoryMap::printField(Stream* serial, const __FlashStringHelper *name, unsigned int value)
+{
+    serial->print( F(", \"") );
+    serial->print( name );
+    serial->print( F("\":") );
+    serial->print( value );
+}
+
+
+void MemoryMap::report(Stream* serial)
+{
+    serial->print( F("{\"event\":\"memory\", \"ram\":") );
+    serial->print( RAMEND - RAMSTART + 1 );
+    printField(serial, F("data"), &__data_end - &__data_start);
+    printField(serial, F("bss"), &__bss_end - &__bss_start);
+    printField(serial, F("heap"), heapEnd() - &__heap_start);
+    printField(serial, F("stackMax"), stackHighWater());
+    printField(serial, F("free"), freeRam());
+    printField(serial, F("minFree"), minFreeRam());
+    printField(serial, F("readQueue"), sizeof(ReadQueue));
+    printField(serial, F("writeQueue"), WRITE_BUFFER_SIZE * sizeof(Frame));
+    printField(serial, F("settings"), sizeof(cbt_settings));
+    serial->println( F("}") );
+}
+
+#endif // MemoryMap_H
@@ -0,0 +1,96 @@
+#ifndef MessageRing_H
+#define MessageRing_H
+
+#include <MessageQueue.h>
+#include "Frame.h"
+
+/*
+*  Single producer, single consumer ring of packed Frame slots
+*
+*  The producer reserves a slot, fills it in place and commits it; the consumer
+*  peeks at the oldest slot, works on it in place and releases it. Only the producer
+*  moves head and only the consumer moves tail, so one side may run in an interrupt.
+*  A ring of size slots holds size - 1 messages.
+*/
+
+#define WRITE_BUFFER_SIZE 12  // Write queue slots, holds 11 frames in 132 bytes (10 Messages took 140)
+
+// Keep the compiler from moving slot accesses across the index update
+#define QUEUE_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+class MessageRing
+{
+public:
+    MessageRing(byte size, Frame *buffer);
+
+    // Producer
+    Frame* reserve();
+    void commit();
+    bool push(const Message &msg);
+
+    // Consumer
+    Frame* peek();
+    void release();
+    Message pop();
+
+    bool isEmpty() { return _head == _tail; }
+    bool isFull() { return next(_head) == _tail; }
+
+private:
+    Frame* _buffer;
+    byte _size;
+    volatile byte _head; // Next slot to fill
+    volatile byte _tail; // Oldest filled slot
+
+    byte next(byte i) { return (i + 1 == _size)? 0 : i + 1; }
+};
+
+MessageRing::MessageRing(byte size, Frame *buffer)
+    : _buffer(buffer), _size(size), _head(0), _tail(0)
+{
+}
+
+// Slot to fill, or NULL when full. Reserving again before commit() returns the same slot.
+Frame* MessageRing::reserve()
+{
+    if (isFull()) return NULL;
+    return &_buffer[_head];
+}
+
+void MessageRing::commit()
+{
+    QUEUE_BARRIER();
+    _head = next(_head);
+}
+
+bool MessageRing::push(const Message &msg)
+{
+    Frame *slot = reserve();
+    if (slot == NULL) return false;
+    slot->pack(msg);
+    commit();
+    return true;
+}
+
+// Oldest message, or NULL when empty. It stays in the ring until release().
+Frame* MessageRing::peek()
+{
+    if (isEmpty()) return NULL;
+    return &_buffer[_tail];
+}
+
+void MessageRing::release()
+{
+    QUEUE_BARRIER();
+    _tail = next(_tail);
+}
+
+Message MessageRing::pop()
+{
+    Message msg;
+    _buffer[_tail].unpack(msg);
+    release();
+    return msg;
+}
+
+#endif // MessageRing_H
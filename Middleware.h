@@ -5,11 +5,12 @@
 #include <MessageQueue.h>
 
 
+// tick() and process() are called directly through Pipeline, only commandHandler() is virtual
 class Middleware
 {
 public:
-    virtual void tick() {};
-    virtual Message process(Message msg) { return msg; };
+    void tick() {};
+    Message process(Message msg) { return msg; };
     virtual void commandHandler(byte* bytes, int length, Stream* activeSerial) {};
     Middleware(){};
     ~Middleware(){};
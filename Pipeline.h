@@ -0,0 +1,88 @@
+#ifndef Pipeline_H
+#define Pipeline_H
+
+#include <MessageQueue.h>
+#include "Middleware.h"
+#include "LoopWatchdog.h"
+
+/*
+*  Compile time middleware pipeline
+*
+*  The middleware instances are plain globals and the pipeline is a list of their
+*  types, so every hook is a direct call the compiler can inline and a stage whose
+*  class doesn't declare tick() or process() generates no code at all.
+*
+*  typedef Pipeline< MW_STAGE(serialCommand), MW_STAGE(mazda3Can) > MiddlewarePipeline;
+*  MiddlewarePipeline::tick();
+*  MiddlewarePipeline::process(msg);
+*
+*  Stage indexes follow the list order and are reported to LoopWatchdog as before.
+*/
+
+template<bool B> struct mw_bool { static const bool value = B; };
+template<typename A, typename B> struct mw_same : mw_bool<false> {};
+template<typename A> struct mw_same<A, A> : mw_bool<true> {};
+
+// A middleware instance and which hooks its class declares
+template<typename T, T &obj>
+struct MiddlewareStage
+{
+    // &T::tick names Middleware::tick unless T declares its own
+    static const bool hasTick = !mw_same<decltype(&T::tick), void (Middleware::*)()>::value;
+    static const bool hasProcess = !mw_same<decltype(&T::process), Message (Middleware::*)(Message)>::value;
+
+    static void tick() { obj.tick(); }
+    static Message process(Message msg) { return obj.process(msg); }
+};
+
+#define MW_STAGE(obj) MiddlewareStage<decltype(obj), obj>
+
+
+template<byte I, typename... Stages>
+struct PipelineRun
+{
+    static void tick() {}
+    static void process(Message &msg) {}
+};
+
+template<byte I, typename S, typename... Rest>
+struct PipelineRun<I, S, Rest...>
+{
+    static void tick()
+    {
+        tickStage(mw_bool<S::hasTick>());
+        PipelineRun<I + 1, Rest...>::tick();
+    }
+
+    static void process(Message &msg)
+    {
+        processStage(msg, mw_bool<S::hasProcess>());
+        PipelineRun<I + 1, Rest...>::process(msg);
+    }
+
+    static void tickStage(mw_bool<false>) {}
+    static void tickStage(mw_bool<true>)
+    {
+        LoopWatchdog::stage(STAGE_TICK, I);
+        S::tick();
+    }
+
+    static void processStage(Message &msg, mw_bool<false>) {}
+    static void processStage(Message &msg, mw_bool<true>)
+    {
+        LoopWatchdog::stage(STAGE_PROCESS, I);
+        msg = S::process(msg);
+    }
+};
+
+
+template<typename... Stages>
+class Pipeline
+{
+public:
+    static const byte length = sizeof...(Stages);
+    static void tick() { PipelineRun<0, Stages...>::tick(); }
+    static void process(Message &msg) { PipelineRun<0, Stages...>::process(msg); }
+};
+
+#endif // Pipeline_H
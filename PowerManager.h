@@ -0,0 +1,197 @@
+#ifndef PowerManager_H
+#define PowerManager_H
+
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <CANBus.h>
+#include "Middleware.h"
+#include "LoopWatchdog.h"
+#include "CBTButtons.h"
+#include "Mazda3CAN.h"
+#include "Settings.h"
+
+/*
+// Power manager commands
+-------------------------
+0xA7 0x01            Print sleep statistics
+0xA7 0x02 SECONDS    Set idle seconds before sleeping (0 = default, 0xFF = never)
+
+When the dashboard is off and no frame was received for the idle time, the MCP2515s
+go to sleep with the wake-up interrupt enabled, the BLE112 is allowed to sleep and
+the ATmega32u4 powers down. Activity on any awake bus pulls its INT pin low and
+wakes everything up. The frame that wakes an MCP2515 is not received.
+Never sleeps while USB is powered, or while an awake bus has its INT pin on a pin that
+isn't an external interrupt (INT0-3, INT6) and so couldn't wake the chip.
+*/
+
+#define POWER_IDLE_DEFAULT 60  // s
+#define POWER_IDLE_NEVER 0xFF
+#define WAKIE 0x40             // CANINTE / CANINTF wake-up bit
+#define RX_OVERFLOW 0xC0       // EFLG RX0OVR | RX1OVR
+
+void powerWakeIsr() {}
+
+class PowerManager : public Middleware
+{
+public:
+    PowerManager(Mazda3CAN *mazda_can);
+    void tick();
+    Message process(Message msg);
+    void commandHandler(byte* bytes, int length, Stream* activeSerial);
+
+private:
+    Mazda3CAN* _mazda;
+    unsigned long _lastActivityMs;
+    unsigned int _sleeps;
+    unsigned long _wakeUs;       // Last wake, interrupt to busses listening again
+    unsigned long _wakeUsMax;
+    unsigned long _lostFrames;   // Wake frames plus RX overflows seen on wake
+
+    unsigned long idleMs();
+    bool canWake();
+    void sleep();
+};
+
+
+PowerManager::PowerManager(Mazda3CAN *mazda_can)
+    : _mazda(mazda_can), _lastActivityMs(0), _sleeps(0), _wakeUs(0), _wakeUsMax(0), _lostFrames(0)
+{
+}
+
+
+unsigned long PowerManager::idleMs()
+{
+    byte s = cbt_settings.sleepDelay;
+    return (s == 0)? POWER_IDLE_DEFAULT * 1000L : s * 1000L;
+}
+
+
+Message PowerManager::process(Message msg)
+{
+    _lastActivityMs = millis();
+    return msg;
+}
+
+
+void PowerManager::tick()
+{
+    if (Serial1.available() > 0) _lastActivityMs = millis();
+    if (_mazda->dashboardOn || cbt_settings.sleepDelay == POWER_IDLE_NEVER) return;
+    if (millis() - _lastActivityMs < idleMs()) return;
+    if (USBSTA & _BV(VBUS)) return;
+    if (!canWake()) return;
+
+    sleep();
+    _lastActivityMs = millis();
+}
+
+
+// Every bus left awake can pull the chip out of power down
+bool PowerManager::canWake()
+{
+    for (byte b = 0; b < 3; b++) {
+        if (cbt_settings.busCfg[b].mode == SLEEP) continue;
+        if (digitalPinToInterrupt(busIntPins[b]) == NOT_AN_INTERRUPT) return false;
+    }
+    return true;
+}
+
+
+void PowerManager::sleep()
+{
+    byte awake = 0;
+
+    // Busses configured to sleep stay asleep without wake-up
+    for (byte b = 0; b < 3; b++) {
+        if (cbt_settings.busCfg[b].mode == SLEEP) continue;
+        awake |= 1 << b;
+        busses[b].bitModify(CANINTF, WAKIE, 0);
+        busses[b].bitModify(CANINTE, WAKIE, WAKIE);
+        busses[b].setMode(SLEEP);
+    }
+    digitalWrite(BT_SLEEP, LOW);
+
+    byte adc = ADCSRA;
+    ADCSRA = 0; // Stops the button sampling chain
+    wdt_disable();
+    for (byte b = 0; b < 3; b++)
+        if (awake & (1 << b)) attachInterrupt(digitalPinToInterrupt(busIntPins[b]), powerWakeIsr, LOW);
+
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    cli();
+    bool pending = false;
+    for (byte b = 0; b < 3; b++)
+        if ((awake & (1 << b)) && digitalRead(busIntPins[b]) == LOW) pending = true;
+    if (!pending) {
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+        cli();
+    }
+    // A LOW level interrupt fires again as long as INT is held, detach before enabling them
+    for (byte b = 0; b < 3; b++)
+        if (awake & (1 << b)) detachInterrupt(digitalPinToInterrupt(busIntPins[b]));
+    sei();
+
+    unsigned long wakeStart = micros();
+    for (byte b = 0; b < 3; b++) {
+        if (!(awake & (1 << b))) continue;
+        // The MCP2515 wakes in listen only mode
+        busses[b].setMode(cbt_settings.busCfg[b].mode);
+        if (busses[b].readRegister(CANINTF) & WAKIE) _lostFrames++;
+        if (busses[b].readRegister(EFLG) & RX_OVERFLOW) {
+            _lostFrames++;
+            busses[b].bitModify(EFLG, RX_OVERFLOW, 0);
+        }
+        busses[b].bitModify(CANINTE, WAKIE, 0);
+        busses[b].bitModify(CANINTF, WAKIE, 0);
+    }
+    _wakeUs = micros() - wakeStart;
+    if (_wakeUs > _wakeUsMax) _wakeUsMax = _wakeUs;
+    _sleeps++;
+
+    if (adc & _BV(ADEN)) ADC_start();
+    digitalWrite(BT_SLEEP, HIGH);
+    LoopWatchdog::resume();
+}
+
+
+void PowerManager::commandHandler(byte* bytes, int length, Stream* activeSerial)
+{
+    if (length == 0) {
+        activeSerial->write(COMMAND_ERROR);
+        return;
+    }
+
+    byte cmd[1];
+    switch (bytes[0]) {
+        case 0x01:
+            activeSerial->print( F("{\"event\":\"power\", \"idle\":") );
+            activeSerial->print(cbt_settings.sleepDelay == POWER_IDLE_NEVER? 0 : idleMs() / 1000);
+            activeSerial->print( F(", \"sleeps\":") );
+            activeSerial->print(_sleeps);
+            activeSerial->print( F(", \"wakeUs\":") );
+            activeSerial->print(_wakeUs);
+            activeSerial->print( F(", \"wakeUsMax\":") );
+            activeSerial->print(_wakeUsMax);
+            activeSerial->print( F(", \"lostFrames\":") );
+            activeSerial->print(_lostFrames);
+            activeSerial->println( F("}") );
+            return;
+        case 0x02:
+            if (readSerialBytes(activeSerial, cmd, 1) != 1) {
+                activeSerial->write(COMMAND_ERROR);
+                return;
+            }
+            Settings::setSleepDelay(cmd[0]);
+            break;
+        default:
+            activeSerial->write(COMMAND_ERROR);
+            return;
+    }
+    activeSerial->write(COMMAND_OK);
+    activeSerial->write(NEWLINE);
+}
+
+#endif // PowerManager_H
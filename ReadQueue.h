@@ -0,0 +1,126 @@
+#ifndef ReadQueue_H
+#define ReadQueue_H
+
+#include <MessageQueue.h>
+#include "MessageRing.h"
+
+/*
+*  Two lane read queue
+*
+*  Frames from RX buffer 0 (high priority filters) and RX buffer 1 (low priority
+*  filters) wait in separate rings of READ_HIGH_SIZE and READ_LOW_SIZE slots, and
+*  pop() always serves the high lane first. When the low lane is full its frames are
+*  dropped while the high lane still has room.
+*
+*  Frames are filled and consumed in place: the producer reserves a slot, reads the
+*  frame straight into it and commits it to a lane, the consumer peeks at the next
+*  frame and releases the slot when done. Safe for one producer and one consumer.
+*
+*  Head and tail count frames and wrap at 256, the lane sizes are powers of two so
+*  no slot is left empty to tell full from empty and no index array is needed:
+*  24 slots take 268 bytes, less than the 280 of the 20 Message slots before.
+*/
+
+#define READ_HIGH_SIZE 8   // Powers of two
+#define READ_LOW_SIZE 16
+#define READ_BUFFER_SIZE (READ_HIGH_SIZE + READ_LOW_SIZE)
+
+// Ring of frame slots, size a power of two up to 128
+struct FrameLane {
+    volatile byte head; // Frames committed, only moved by the producer
+    volatile byte tail; // Frames released, only moved by the consumer
+
+    void clear() { head = tail = 0; }
+    bool isEmpty() { return head == tail; }
+    byte count() { return (byte)(head - tail); }
+};
+
+class ReadQueue
+{
+public:
+    ReadQueue();
+
+    // Producer
+    Frame* reserve(bool high);
+    void commit(bool high);
+    bool push(const Message &msg, bool high);
+
+    // Consumer
+    Frame* peek();
+    void release();
+    Message pop();
+
+    bool isEmpty() { return _high.isEmpty() && _low.isEmpty(); }
+    bool canPush(bool high) { return high? _high.count() < READ_HIGH_SIZE : _low.count() < READ_LOW_SIZE; }
+    byte length() { return _high.count() + _low.count(); }
+    void dropped(bool high) { if (high) droppedHigh++; else droppedLow++; }
+
+    unsigned long droppedHigh;
+    unsigned long droppedLow;
+
+private:
+    Frame _highSlots[READ_HIGH_SIZE];
+    Frame _lowSlots[READ_LOW_SIZE];
+    FrameLane _high;
+    FrameLane _low;
+    bool _peekedHigh; // Lane of the slot returned by peek()
+};
+
+ReadQueue::ReadQueue() : droppedHigh(0), droppedLow(0), _peekedHigh(false)
+{
+    _high.clear();
+    _low.clear();
+}
+
+// Slot to fill, or NULL when the lane is full. Until commit() the same slot is handed out again.
+Frame* ReadQueue::reserve(bool high)
+{
+    if (!canPush(high)) return NULL;
+    if (high) return &_highSlots[_high.head & (READ_HIGH_SIZE - 1)];
+    return &_lowSlots[_low.head & (READ_LOW_SIZE - 1)];
+}
+
+void ReadQueue::commit(bool high)
+{
+    QUEUE_BARRIER();
+    if (high) _high.head++;
+    else _low.head++;
+}
+
+bool ReadQueue::push(const Message &msg, bool high)
+{
+    Frame *slot = reserve(high);
+    if (slot == NULL) {
+        dropped(high);
+        return false;
+    }
+    slot->pack(msg);
+    commit(high);
+    return true;
+}
+
+// Next frame, high lane first, or NULL when empty. It stays queued until release().
+Frame* ReadQueue::peek()
+{
+    _peekedHigh = !_high.isEmpty();
+    if (_peekedHigh) return &_highSlots[_high.tail & (READ_HIGH_SIZE - 1)];
+    if (_low.isEmpty()) return NULL;
+    return &_lowSlots[_low.tail & (READ_LOW_SIZE - 1)];
+}
+
+void ReadQueue::release()
+{
+    QUEUE_BARRIER();
+    if (_peekedHigh) _high.tail++;
+    else _low.tail++;
+}
+
+Message ReadQueue::pop()
+{
+    Message msg;
+    peek()->unpack(msg);
+    release();
+    return msg;
+}
+
+#endif // ReadQueue_H
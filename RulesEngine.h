@@ -0,0 +1,306 @@
+#ifndef RulesEngine_H
+#define RulesEngine_H
+
+#include <stddef.h>
+#include <avr/eeprom.h>
+#include "Middleware.h"
+#include "Mazda3CAN.h"
+#include "Mazda3Lcd.h"
+#include "CBTButtons.h"
+#include "Settings.h"
+
+/*
+// Rules commands
+-----------------
+0xA8 0x01               Print rules and their state
+0xA8 0x02 LEN BYTES     Replace all rules with LEN bytes of rules, saved to EEPROM
+0xA8 0x03               Delete all rules
+
+Rules are stored back to back in cbt_settings.rules, a size of 0 or 0xFF ends them:
+SIZE ACTION ARG CODELEN CODE[CODELEN] TEXT[SIZE - 4 - CODELEN]
+
+CODE is a stack program that reads at least one Mazda3CAN signal, true when it leaves a
+non zero value.
+A rule only runs when one of the signals it reads changes, and its action only runs when
+the result changes:
+  RULE_RELAY      Relay on while true, off while false
+  RULE_MESSAGE    Show TEXT on the LCD for ARG * 100 ms when it becomes true
+
+Example, relay on in reverse above 5 km/h:
+  0x10 0x01 0x00 0x0C  0x01 0x02 0x02 0x0E 0x10  0x01 0x01 0x03 0x01 0xF4 0x13  0x20
+*/
+
+#define RULES_SIZE 96
+#define RULES_MAX 8
+#define RULES_STACK 6
+#define RULE_HEADER 4
+#define RULE_TEXT 12  // LCD characters
+
+// Actions
+#define RULE_RELAY   0x01
+#define RULE_MESSAGE 0x02
+
+// Opcodes. Binary ops pop b then a and push a OP b
+#define OP_SIGNAL  0x01  // + signal id, see Mazda3CAN::signal
+#define OP_CONST8  0x02  // + unsigned byte
+#define OP_CONST16 0x03  // + signed word, MSB first
+#define OP_EQ      0x10
+#define OP_NE      0x11
+#define OP_LT      0x12
+#define OP_GT      0x13
+#define OP_LE      0x14
+#define OP_GE      0x15
+#define OP_AND     0x20
+#define OP_OR      0x21
+#define OP_NOT     0x22  // Unary
+#define OP_ADD     0x30
+#define OP_SUB     0x31
+
+class RulesEngine : public Middleware
+{
+public:
+    RulesEngine(Mazda3CAN *mazda_can, Mazda3Lcd *mazda_lcd, CBTButtons *buttons);
+    bool begin();
+    void tick();
+    void commandHandler(byte* bytes, int length, Stream* activeSerial);
+
+private:
+    Mazda3CAN* _mazda;
+    Mazda3Lcd* _lcd;
+    CBTButtons* _buttons;
+    byte _count;
+    byte _offset[RULES_MAX];
+    unsigned int _deps[RULES_MAX];  // Signals read by each rule
+    byte _state;                    // Last result, one bit per rule
+    byte _pending;                  // Rules to run on the next tick whatever changed
+    byte _revision;                 // settingsRevision the rules were indexed from
+    unsigned long _evaluations;
+
+    unsigned int check(byte offset);
+    bool evaluate(const byte *code, byte length);
+    void run(byte r);
+    void printRules(Stream* serial);
+};
+
+
+RulesEngine::RulesEngine(Mazda3CAN *mazda_can, Mazda3Lcd *mazda_lcd, CBTButtons *buttons)
+    : _mazda(mazda_can), _lcd(mazda_lcd), _buttons(buttons), _count(0), _state(0), _pending(0), _revision(0), _evaluations(0)
+{
+}
+
+
+/*
+*  Index the rules in cbt_settings, false and no rules if any of them is malformed
+*/
+bool RulesEngine::begin()
+{
+    byte offset = 0;
+    _count = _state = 0;
+    _revision = settingsRevision;
+
+    while (offset < RULES_SIZE && cbt_settings.rules[offset] != 0 && cbt_settings.rules[offset] != 0xFF) {
+        unsigned int deps = check(offset);
+        if (deps == 0 || _count == RULES_MAX) {
+            _count = 0;
+            return false;
+        }
+        _offset[_count] = offset;
+        _deps[_count++] = deps;
+        offset += cbt_settings.rules[offset];
+    }
+    _pending = (1 << _count) - 1;
+    return true;
+}
+
+
+/*
+*  Signals read by the rule at offset, 0 if it's malformed
+*/
+unsigned int RulesEngine::check(byte offset)
+{
+    const byte *rule = cbt_settings.rules + offset;
+    byte size = rule[0];
+    byte codeLength = rule[3];
+    if (size < RULE_HEADER + 1 || size > RULES_SIZE - offset || codeLength == 0 || codeLength > size - RULE_HEADER)
+        return 0;
+    if (rule[1] == RULE_MESSAGE) {
+        if (size - RULE_HEADER - codeLength > RULE_TEXT) return 0;
+    } else if (rule[1] != RULE_RELAY) return 0;
+
+    const byte *code = rule + RULE_HEADER;
+    unsigned int deps = 0;
+    byte depth = 0;
+    for (byte i = 0; i < codeLength; ) {
+        byte op = code[i++];
+        switch (op) {
+            case OP_SIGNAL:
+                if (i >= codeLength || code[i] >= MAZDA_SIGNALS) return 0;
+                deps |= Mazda3CAN::signalBit(code[i++]);
+                depth++;
+                break;
+            case OP_CONST8:
+            case OP_CONST16:
+                i += (op == OP_CONST8)? 1 : 2;
+                if (i > codeLength) return 0;
+                depth++;
+                break;
+            case OP_NOT:
+                if (depth < 1) return 0;
+                break;
+            case OP_EQ: case OP_NE: case OP_LT: case OP_GT: case OP_LE: case OP_GE:
+            case OP_AND: case OP_OR: case OP_ADD: case OP_SUB:
+                if (depth < 2) return 0;
+                depth--;
+                break;
+            default:
+                return 0;
+        }
+        if (depth > RULES_STACK) return 0;
+    }
+    return (depth == 1)? deps : 0;
+}
+
+
+/*
+*  check() already rejected bad code, the bounds are checked again in case the rules
+*  changed since, e.g. while settings are being written. False on bad code.
+*/
+bool RulesEngine::evaluate(const byte *code, byte length)
+{
+    long stack[RULES_STACK];
+    byte sp = 0;
+
+    for (byte i = 0; i < length; ) {
+        byte op = code[i++];
+        if (op == OP_SIGNAL || op == OP_CONST8 || op == OP_CONST16) {
+            byte n = (op == OP_CONST16)? 2 : 1;
+            if (sp == RULES_STACK || length - i < n) return false;
+            if (op == OP_SIGNAL) stack[sp++] = _mazda->signal(code[i]);
+            else if (op == OP_CONST8) stack[sp++] = code[i];
+            else stack[sp++] = (int)(((unsigned int)code[i] << 8) | code[i + 1]);
+            i += n;
+        } else if (op == OP_NOT) {
+            if (sp < 1) return false;
+            stack[sp - 1] = !stack[sp - 1];
+        } else {
+            if (sp < 2) return false;
+            long b = stack[--sp];
+            long &a = stack[sp - 1];
+            switch (op) {
+                case OP_EQ:  a = (a == b); break;
+                case OP_NE:  a = (a != b); break;
+                case OP_LT:  a = (a < b); break;
+                case OP_GT:  a = (a > b); break;
+                case OP_LE:  a = (a <= b); break;
+                case OP_GE:  a = (a >= b); break;
+                case OP_AND: a = (a && b); break;
+                case OP_OR:  a = (a || b); break;
+                case OP_ADD: a += b; break;
+                case OP_SUB: a -= b; break;
+                default: return false;
+            }
+        }
+    }
+    return sp == 1 && stack[0] != 0;
+}
+
+
+void RulesEngine::tick()
+{
+    if (_revision != settingsRevision) begin();  // Settings replaced, e.g. restored from the host
+
+    unsigned int changes = _mazda->takeChanges(LISTENER_RULES);
+    byte due = _pending;
+    _pending = 0;
+    if (changes == 0 && due == 0) return;
+
+    for (byte r = 0; r < _count; r++)
+        if ((_deps[r] & changes) || (due & (1 << r))) run(r);
+}
+
+
+void RulesEngine::run(byte r)
+{
+    const byte *rule = cbt_settings.rules + _offset[r];
+    byte mask = 1 << r;
+    bool result = evaluate(rule + RULE_HEADER, rule[3]);
+    _evaluations++;
+    if (result == ((_state & mask) != 0)) return;
+    if (result) _state |= mask; else _state &= ~mask;
+
+    if (rule[1] == RULE_RELAY) {
+        _buttons->setRelay(result);
+    } else if (result) {
+        char text[RULE_TEXT + 1];
+        byte length = rule[0] - RULE_HEADER - rule[3];
+        if (length > RULE_TEXT) length = RULE_TEXT;
+        memcpy(text, rule + RULE_HEADER + rule[3], length);
+        memset(text + length, ' ', RULE_TEXT - length);
+        text[RULE_TEXT] = 0;
+        _lcd->showMessage(text, rule[2] * 100);
+    }
+}
+
+
+void RulesEngine::printRules(Stream* serial)
+{
+    serial->print( F("{\"event\":\"rules\", \"evaluations\":") );
+    serial->print(_evaluations);
+    serial->print( F(", \"rules\":[") );
+    for (byte r = 0; r < _count; r++) {
+        const byte *rule = cbt_settings.rules + _offset[r];
+        if (r > 0) serial->print( F(", ") );
+        serial->print( F("{\"action\":") );
+        serial->print(rule[1]);
+        serial->print( F(", \"signals\":") );
+        serial->print(_deps[r]);
+        serial->print( F(", \"state\":") );
+        serial->print((_state >> r) & 1);
+        serial->print( F("}") );
+    }
+    serial->println( F("]}") );
+}
+
+
+void RulesEngine::commandHandler(byte* bytes, int length, Stream* activeSerial)
+{
+    if (length == 0) {
+        activeSerial->write(COMMAND_ERROR);
+        return;
+    }
+
+    byte size;
+    switch (bytes[0]) {
+        case 0x01:
+            printRules(activeSerial);
+            return;
+        case 0x02:
+            // Read in place, the previous rules come back from EEPROM if the new ones are bad
+            if (readSerialBytes(activeSerial, &size, 1) != 1 || size > RULES_SIZE ||
+                readSerialBytes(activeSerial, cbt_settings.rules, size) != size) {
+                size = 0xFF;
+            } else {
+                if (size < RULES_SIZE) cbt_settings.rules[size] = 0;
+                if (!begin()) size = 0xFF;
+            }
+            if (size == 0xFF) {
+                eeprom_read_block(cbt_settings.rules, (void*)offsetof(struct cbt_settings, rules), RULES_SIZE);
+                begin();
+                activeSerial->write(COMMAND_ERROR);
+                return;
+            }
+            break;
+        case 0x03:
+            cbt_settings.rules[0] = 0;
+            begin();
+            break;
+        default:
+            activeSerial->write(COMMAND_ERROR);
+            return;
+    }
+    Settings::save(&cbt_settings);
+    activeSerial->write(COMMAND_OK);
+    activeSerial->write(NEWLINE);
+}
+
+#endif // RulesEngine_H
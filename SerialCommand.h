@@ -5,12 +5,16 @@
 System info and EEPROM
 ----------------------
 0x01 0x01            Print system debug to serial
-0x01 0x02            Dump EEPROM value
+0x01 0x02            Dump EEPROM value (blocks the loop, see 0x06 for backups)
 0x01 0x03            Read and save EEPROM
 0x01 0x04            Restore EEPROM to stock values
+0x01 0x05            Print watchdog stall report
+0x01 0x06            Print memory map and stack high-water mark
 0x01 0x09 0x01 N     Set baud rate on bus 1 to N (N is 16 bits)
 0x01 0x0A BUS  MODE  Get CAN mode on bus BUS, or Set CAN mode MODE on bus BUS
-                     (CONFIGURATION = 0, NORMAL = 1, SLEEP = 2, LISTEN = 3, LOOPBACK = 4)
+                     (CONFIGURATION = 0, NORMAL = 1, SLEEP = 2, LISTEN = 3, LOOPBACK = 4), applied at once
+0x01 0x0B BUS  SHARE Get read share of bus BUS, or Set it to SHARE frames per loop (0 = default)
+0x01 0x0C ENC        Get log encoding, or Set it to ENC (0 = 0x03 records, 1 = delta records, see LogEncoder.h)
 0x01 0x10 0x01       Print bus 1 debug to serial
 0x01 0x10 0x02       Print bus 2 debug to serial
 0x01 0x10 0x03       Print bus 3 debug to serial
@@ -34,6 +38,12 @@ Cmd  Bus  On/Off MsgId1 MsgId2
 0x03 0x01 0x02   0x290  0xFFF 0x400  0xFF0  // Enable logging on Bus 1 filter messages 0x290 and 0x40* (0 in mask is a wildcard)
 0x03 0x01 0x02   0x000  0x000               // Enable logging on Bus 1 for ALL messages
 
+Log record: 0x03 BUS IDH IDL D0-D7 LEN STATUS \r \n
+STATUS bit 0 / 1: RX0IF / RX1IF, RX buffer 0 / 1 was full when the frame was read, in the
+bit positions of the MCP2515 READ STATUS byte. Both can be set, they don't tell which buffer
+held the frame. Since version 0.7 the other bits are 0, up to 0.6 they held the TX flags
+of READ STATUS. The version is in the 0x01 0x01 reply.
+
 
 Set Bluetooth Message ID filter
 ----------------------------------------
@@ -41,6 +51,28 @@ Cmd  Bus  Message Id 1 Message Id 2
 0x04 0x01 0x290        0x291            // Enable Message ID 290 output over BT
 0x04 0x01 0x0000       0x0000           // Disable
 
+Logging over Bluetooth is paced by a token bucket of bytes matched to the BLE112 throughput.
+Filtered ids are coalesced: only the latest frame of each id is kept and sent
+as soon as the link allows. Busses without filters send what fits and drop the rest.
+
+
+Settings block transfer
+-----------------------
+Cmd  Op   Offset Length Window
+0x06 0x01 0x0000 0x0200 0x04      // Send 512 bytes of EEPROM from offset 0, 4 blocks unacked at most (0 = default)
+0x06 0x02 0x0000 0x0200           // Receive 512 bytes of settings at offset 0 and save them to EEPROM
+Runs from tick() in 16 byte blocks with CRC and acks, see BlockTransfer.h for the packets.
+Received settings only take effect once every block has arrived intact.
+A save cut short by a reset is finished from the scratch copy at the next boot.
+Logging and signal updates on the port pause until the transfer ends.
+
+
+SLCAN mode
+----------
+Cmd  Bus
+0x05 0x01                         // Switch USB to slcan (Lawicel) ASCII mode on bus 1
+ESC or closing the USB port switches back to these binary commands, see Slcan.h for the slcan commands.
+
 
 Bluetooth Functions
 -------------------
@@ -61,13 +93,33 @@ TODO: Implement this ^^^
 #define COMMAND_OK 0xFF
 #define COMMAND_ERROR 0x80
 #define NEWLINE "\r\n"
-#define MAX_MW_CALLBACKS 8
+#define MAX_MW_CALLBACKS 12
+#define MAX_MW_DATA_LENGTH 8 // Longest fixed body of a middleware command
 #define BT_SEND_DELAY 20
+#define BT_REFILL_BYTES 8     // BLE112 drains 8 bytes every BT_SEND_DELAY ms
+#define BT_BUCKET_SIZE 64     // Max burst in bytes
+#define BT_FILTER_IDS 2       // Message id filters per bus
+#ifdef JSON_OUT
+#define BT_RECORD_SIZE 160
+#else
+#define BT_RECORD_SIZE 16     // Bytes of a 0x03 log record
+#endif
 #define COMMAND_TIMEOUT 100   // ms to wait before serial command timeout
 
 #include <CANBus.h>
 #include <MessageQueue.h>
+#include "MessageRing.h"
 #include "Middleware.h"
+#include "LoopWatchdog.h"
+#include "MemoryMap.h"
+#include "BusScheduler.h"
+#include "Mcp2515Rx.h"
+#include "Slcan.h"
+#include "LogEncoder.h"
+#include "BlockTransfer.h"
+
+
+int readSerialBytes( Stream* serial, byte* buf, int length );
 
 
 struct middleware_command {
@@ -80,17 +132,23 @@ struct middleware_command {
 class SerialCommand : public Middleware
 {
 public:
-    SerialCommand( MessageQueue *q );
+    SerialCommand( MessageRing *q );
     void tick();
     Message process(Message msg);
     Stream* activeSerial;
-    void printMessageToSerial(Message msg);
+    void printMessageToSerial(Message msg, Stream* serial);
     void registerCommand(byte commandId, int dataLength, Middleware *cbInstance);
     void resetToBootloader();
+    bool slcanActive() { return slcan.active(); }
+    bool transferActive(Stream* serial) { return transfer.owns(serial); }
+    int btRoom();
+    void btSpend(int bytes) { btTokens -= bytes; }
 
 private:
-    int freeRam();
-    MessageQueue* mainQueue;
+    MessageRing* mainQueue;
+    Slcan slcan;
+    LogEncoder logEncoder;
+    BlockTransfer transfer;
     void printChannelDebug();
     void printChannelDebug(CANBus);
     void processCommand(byte command);
@@ -98,22 +156,36 @@ private:
     void clearBuffer();
     void getAndSend();
     void printSystemDebug();
+    void printBootTiming(Stream* serial);
+    bool bootReported;
+    bool stallReported;
     void settingsCall();
     void dumpEeprom();
     void getAndSaveEeprom();
     void bitRate();
     void canMode();
+    void readShare();
+    void logEncoding();
+    byte logRecordSize(const Message &msg);
     void logCommand();
     void bluetooth();
     void setBluetoothFilter();
-    char btMessageIdFilters[][2];
+    void slcanMode();
+    void blockTransfer();
+    void transferTick();
+    unsigned short btMessageIdFilters[3][BT_FILTER_IDS];
+    Message btPending[3 * BT_FILTER_IDS]; // Latest frame of each filtered id
+    byte btPendingMask;
+    byte btNextPending;
+    int btTokens;
+    unsigned long btRefillTst;
+    void btQueue(Message msg);
+    void btFlush();
     boolean passthroughMode;
     byte busLogEnabled;
     void printEFLG(CANBus);
     int byteCount;
     void btDelay();
-    bool btRateLimit();
-    unsigned long lastBluetoothRX;
 };
 
 
@@ -122,23 +194,20 @@ int byteCount = 0;
 struct middleware_command mw_cmds[MAX_MW_CALLBACKS];
 
 
-SerialCommand::SerialCommand(MessageQueue *q )
+SerialCommand::SerialCommand(MessageRing *q ) : slcan(q)
 {
     mainQueue = q;
 
-//  // TODO Finish this
-//  btMessageIdFilters[][2] = {
-//      {0x28F,0x290},
-//      {0x0,0x0},
-//      {0x28F,0x290},
-//  };
-//
-
     // Default Instance Properties
     busLogEnabled = 0;        // Start with all busses logging disabled
     passthroughMode = false;
+    bootReported = false;
+    stallReported = false;
     activeSerial = &Serial;
-    lastBluetoothRX = 0;
+    memset(btMessageIdFilters, 0, sizeof(btMessageIdFilters));
+    btPendingMask = btNextPending = 0;
+    btTokens = BT_BUCKET_SIZE;
+    btRefillTst = 0;
 }
 
 
@@ -153,12 +222,33 @@ void SerialCommand::tick()
         return;
     }
 
-    if( Serial1.available() > 0 ){
+    btFlush();
+    transferTick();
+
+    // Watchdog record of the last reset, once the USB port is open
+    if( !stallReported && Serial ){
+        LoopWatchdog::report( &Serial );
+        stallReported = true;
+    }
+
+    // Time to first frame, once the USB port is open
+    if( !bootReported && firstFrameUs != 0 && Serial ){
+        printBootTiming( &Serial );
+        bootReported = true;
+    }
+
+    if( Serial1.available() > 0 && !transfer.owns(&Serial1) ){
         activeSerial = &Serial1;
         processCommand( Serial1.read() );
     }
 
-    if( Serial.available() > 0 ){
+    if( slcan.active() ){
+        // Host closed the port, back to binary commands for the next connection
+        if( !Serial ) slcan.end();
+        while( slcan.active() && Serial.available() > 0 ) slcan.feed( Serial.read() );
+        if( slcan.active() ) slcan.tick();
+    }
+    else if( Serial.available() > 0 && !transfer.owns(&Serial) ){
         activeSerial = &Serial;
         processCommand( Serial.read() );
     }
@@ -167,11 +257,79 @@ void SerialCommand::tick()
 
 Message SerialCommand::process(Message msg)
 {
-    if (busLogEnabled & (0x1 << (msg.busId - 1))) printMessageToSerial(msg);
+    if (slcan.active()) slcan.frame(msg);
+    if (busLogEnabled & (0x1 << (msg.busId - 1))) {
+        if (activeSerial == &Serial1) btQueue(msg);
+        else if (!slcan.active() && !transfer.owns(activeSerial)) printMessageToSerial(msg, activeSerial);
+    }
     return msg;
 }
 
 
+/*
+*  Queue a frame for Bluetooth output. Filtered ids keep only their latest frame.
+*/
+void SerialCommand::btQueue(Message msg)
+{
+    byte bus = msg.busId - 1;
+    bool filtered = false;
+    for (byte f = 0; f < BT_FILTER_IDS; f++) {
+        if (btMessageIdFilters[bus][f] == 0) continue;
+        filtered = true;
+        if (btMessageIdFilters[bus][f] == msg.frame_id) {
+            byte slot = bus * BT_FILTER_IDS + f;
+            btPending[slot] = msg;
+            btPendingMask |= 1 << slot;
+            return;
+        }
+    }
+
+    // Without filters on this bus send straight away if the link has room
+    if (!filtered) {
+        byte size = logRecordSize(msg);
+        if (btTokens < size || transfer.owns(&Serial1)) return;
+        btTokens -= size;
+        printMessageToSerial(msg, &Serial1);
+    }
+}
+
+
+/*
+*  Bluetooth bytes other middleware can send now, to be charged with btSpend()
+*/
+int SerialCommand::btRoom()
+{
+    if (transfer.owns(&Serial1)) return 0;
+    int room = Serial1.availableForWrite();
+    return (btTokens < room)? btTokens : room;
+}
+
+
+/*
+*  Refill the token bucket and send pending frames, round robin between ids
+*/
+void SerialCommand::btFlush()
+{
+    unsigned long elapsed = millis() - btRefillTst;
+    if (elapsed >= BT_SEND_DELAY) {
+        unsigned int refill = (elapsed / BT_SEND_DELAY) * BT_REFILL_BYTES;
+        btTokens = (btTokens + refill > BT_BUCKET_SIZE)? BT_BUCKET_SIZE : btTokens + refill;
+        btRefillTst += (elapsed / BT_SEND_DELAY) * BT_SEND_DELAY;
+    }
+
+    while (btPendingMask && !transfer.owns(&Serial1)) {
+        while ((btPendingMask & (1 << btNextPending)) == 0)
+            btNextPending = (btNextPending + 1) % (3 * BT_FILTER_IDS);
+        byte size = logRecordSize(btPending[btNextPending]);
+        if (btTokens < size || Serial1.availableForWrite() < size) break;
+        btPendingMask &= ~(1 << btNextPending);
+        btTokens -= size;
+        printMessageToSerial(btPending[btNextPending], &Serial1);
+        btNextPending = (btNextPending + 1) % (3 * BT_FILTER_IDS);
+    }
+}
+
+
 void SerialCommand::processCommand(byte command)
 {
 //  Commented out because causes corrupted data when sending serial to Android Bluetooth
@@ -191,6 +349,12 @@ void SerialCommand::processCommand(byte command)
         case 0x04:
             setBluetoothFilter();
             break;
+        case 0x05:
+            slcanMode();
+            break;
+        case 0x06:
+            blockTransfer();
+            break;
         case 0x08:
             bluetooth();
             break;
@@ -199,7 +363,7 @@ void SerialCommand::processCommand(byte command)
             for(int i = 0; i < mwCommandIndex; i++ ){
                 if( mw_cmds[i].command != command ) continue;
 
-                byte cmd[mw_cmds[i].dataLength];
+                byte cmd[MAX_MW_DATA_LENGTH];
                 int bytesRead = getCommandBody( cmd, mw_cmds[i].dataLength );
                 delay(1);
                 mw_cmds[i].cbInstance->commandHandler(cmd, bytesRead, activeSerial);
@@ -212,44 +376,46 @@ void SerialCommand::processCommand(byte command)
 }
 
 
-void SerialCommand::printMessageToSerial( Message msg )
+void SerialCommand::printMessageToSerial( Message msg, Stream* serial )
 {
-    // Bluetooth rate limiting
-    if ( activeSerial == &Serial1 && btRateLimit() ) return;
-
 #ifdef JSON_OUT
 
     // Output to serial as json string
-    activeSerial->print(F("{\"packet\": {\"status\":\""));
-    activeSerial->print( msg.busStatus, HEX);
-    activeSerial->print(F("\",\"channel\":\""));
-    activeSerial->print( busses[msg.busId-1].name );
-    activeSerial->print(F("\",\"length\":\""));
-    activeSerial->print(msg.length, HEX);
-    activeSerial->print(F("\",\"id\":\""));
-    activeSerial->print(msg.frame_id, HEX);
-    activeSerial->print(F("\",\"timestamp\":\""));
-    activeSerial->print(millis(), DEC);
-    activeSerial->print(F("\",\"payload\":[\""));
+    serial->print(F("{\"packet\": {\"status\":\""));
+    serial->print( msg.busStatus, HEX);
+    serial->print(F("\",\"channel\":\""));
+    serial->print( busses[msg.busId-1].name );
+    serial->print(F("\",\"length\":\""));
+    serial->print(msg.length, HEX);
+    serial->print(F("\",\"id\":\""));
+    serial->print(msg.frame_id, HEX);
+    serial->print(F("\",\"timestamp\":\""));
+    serial->print(millis(), DEC);
+    serial->print(F("\",\"payload\":[\""));
     for (int i = 0; i < 8; i++) {
-        activeSerial->print(msg.frame_data[i], HEX);
-        if(i < 7) activeSerial->print(F("\",\""));
+        serial->print(msg.frame_data[i], HEX);
+        if(i < 7) serial->print(F("\",\""));
     }
-    activeSerial->print(F("\"]}}"));
-    activeSerial->println();
+    serial->print(F("\"]}}"));
+    serial->println();
 
 #else
 
-    activeSerial->write( 0x03 ); // Prefix with logging command
-    activeSerial->write( msg.busId );
-    activeSerial->write( msg.frame_id >> 8 );
-    activeSerial->write( msg.frame_id );
+    if (logEncoder.delta()) {
+        logEncoder.write(msg, serial);
+        return;
+    }
+
+    serial->write( 0x03 ); // Prefix with logging command
+    serial->write( msg.busId );
+    serial->write( msg.frame_id >> 8 );
+    serial->write( msg.frame_id );
 
-    for (int i = 0; i < 8; i++) activeSerial->write(msg.frame_data[i]);
+    for (int i = 0; i < 8; i++) serial->write(msg.frame_data[i]);
 
-    activeSerial->write( msg.length );
-    activeSerial->write( msg.busStatus );
-    activeSerial->write( NEWLINE );
+    serial->write( msg.length );
+    serial->write( msg.busStatus );
+    serial->write( NEWLINE );
 
 #endif
 }
@@ -274,12 +440,24 @@ void SerialCommand::settingsCall()
         case 0x04:
             Settings::firstbootSetup();
             break;
+        case 0x05:
+            LoopWatchdog::report(activeSerial);
+            break;
+        case 0x06:
+            MemoryMap::report(activeSerial);
+            break;
         case 0x09:
             bitRate();
             break;
         case 0x0A:
             canMode();
             break;    
+        case 0x0B:
+            readShare();
+            break;
+        case 0x0C:
+            logEncoding();
+            break;
         case 0x10:
             printChannelDebug();
             break;
@@ -290,14 +468,28 @@ void SerialCommand::settingsCall()
 }
 
 
+// Bytes printMessageToSerial() sends for msg on Bluetooth
+byte SerialCommand::logRecordSize(const Message &msg)
+{
+#ifdef JSON_OUT
+    return BT_RECORD_SIZE;
+#else
+    return logEncoder.delta()? logEncoder.recordSize(msg, &Serial1) : BT_RECORD_SIZE;
+#endif
+}
+
+
 void SerialCommand::setBluetoothFilter()
 {
     byte cmd[5];
-    getCommandBody( cmd, 5 );
-
-    if( cmd[0] >= 0 && cmd[0] <= 3 ){
-        btMessageIdFilters[cmd[0]][0] = (cmd[1] << 8)+cmd[2];
-        btMessageIdFilters[cmd[0]][1] = (cmd[3] << 8)+cmd[4];
+    if (getCommandBody( cmd, 5 ) != 5) return;
+
+    if( cmd[0] >= 1 && cmd[0] <= 3 ){
+        byte bus = cmd[0] - 1;
+        btMessageIdFilters[bus][0] = (cmd[1] << 8)+cmd[2];
+        btMessageIdFilters[bus][1] = (cmd[3] << 8)+cmd[4];
+        // Drop frames pending for the old filters
+        btPendingMask &= ~(((1 << BT_FILTER_IDS) - 1) << (bus * BT_FILTER_IDS));
     }
 }
 
@@ -318,13 +510,29 @@ void SerialCommand::bitRate()
 }
 
 
+void SerialCommand::logEncoding()
+{
+    byte cmd[1];
+
+    if (getCommandBody( cmd, 1 ) == 1 && cmd[0] <= 1) logEncoder.setDelta( cmd[0] == 1 );
+
+    activeSerial->print( F( "{\"event\":\"log-encoding\", \"mode\":" ) );
+    activeSerial->print( logEncoder.delta()? 1 : 0 );
+    activeSerial->println( F( "}" ) );
+}
+
+
 void SerialCommand::canMode()
 {  
     byte cmd[2], bytesRead;
 
     bytesRead = getCommandBody( cmd, 2 );
 
-    if (bytesRead == 2) Settings::setCanMode( cmd[0], cmd[1] );
+    if (bytesRead == 2 && cmd[0] >= 1 && cmd[0] <= 3) {
+        Settings::setCanMode( cmd[0], cmd[1] );
+        busses[cmd[0] - 1].setMode( Settings::getCanMode(cmd[0]) );
+        busScheduler.setMode( cmd[0] - 1, Settings::getCanMode(cmd[0]) );
+    }
     
     CANMode mode = Settings::getCanMode( cmd[0] );
 
@@ -355,6 +563,22 @@ void SerialCommand::canMode()
 }
 
 
+void SerialCommand::readShare()
+{
+    byte cmd[2], bytesRead;
+
+    bytesRead = getCommandBody( cmd, 2 );
+
+    if (bytesRead == 2) Settings::setReadShare( cmd[0], cmd[1] );
+
+    activeSerial->print( F( "{\"event\":\"read-share-bus" ) );
+    activeSerial->print(cmd[0]);
+    activeSerial->print( F( "\", \"share\":" ) );
+    activeSerial->print( (cmd[0] >= 1 && cmd[0] <= 3)? busScheduler.share(cmd[0] - 1) : 0 );
+    activeSerial->println( F( "}" ) ); 
+}
+
+
 void SerialCommand::logCommand()
 {
     byte cmd[8] = {0};
@@ -410,6 +634,7 @@ void SerialCommand::getAndSaveEeprom()
 
     if ( bytesRead == CHUNK_SIZE + 2 && cmd[CHUNK_SIZE+1] == 0xA1 ) {
         memcpy( settings+(cmd[0]*CHUNK_SIZE), &cmd[1], CHUNK_SIZE );
+        Settings::replaced();
 
         activeSerial->print( F("{\"event\":\"eepromData\", \"result\":\"success\", \"chunk\":\"") );
         activeSerial->print(cmd[0]);
@@ -451,6 +676,18 @@ void SerialCommand::getAndSend()
 }
 
 
+void SerialCommand::slcanMode()
+{
+    byte cmd[1];
+    if (getCommandBody( cmd, 1 ) != 1 || cmd[0] < 1 || cmd[0] > 3 || activeSerial != &Serial) {
+        activeSerial->write( COMMAND_ERROR );
+        return;
+    }
+    slcan.begin( cmd[0], &Serial );
+    Serial.write( SLCAN_OK );
+}
+
+
 void SerialCommand::bluetooth()
 {
     byte cmd[1];
@@ -478,18 +715,28 @@ void SerialCommand::bluetooth()
 
 
 int SerialCommand::getCommandBody( byte* cmd, int length )
+{
+    return readSerialBytes( activeSerial, cmd, length );
+}
+
+
+/*
+*  Read length bytes from serial, waiting at most COMMAND_TIMEOUT ms overall.
+*  Also used by middleware command handlers to read variable length bodies.
+*/
+int readSerialBytes( Stream* serial, byte* buf, int length )
 {
     // Loop until requested amount of bytes are received. Needed for BT latency
     int i = 0;
     int timeout = COMMAND_TIMEOUT;
     while( i < length ) {
         // Cannot simply use delay() because Android Bluetooth gets corrupted data
-        while(activeSerial->available() == 0 && timeout > 0) {
+        while(serial->available() == 0 && timeout > 0) {
             delay(1);
             timeout--;
         }
         if (timeout < 1) return i;
-        cmd[i] = activeSerial->read();
+        buf[i] = serial->read();
         i++;
     }
     return i;
@@ -504,13 +751,26 @@ void SerialCommand::clearBuffer()
 
 void SerialCommand::printSystemDebug()
 {
-    activeSerial->print("{\"event\":\"version\", \"name\":\""+String(BUILDNAME)+"\", "+
+    activeSerial->print( F("{\"event\":\"version\", \"name\":\"" BUILDNAME "\", ") );
 #ifdef BUILD_VERSION
-     "\"version\":\""+String(BUILD_VERSION)+"\", "+
+    activeSerial->print( F("\"version\":\"" BUILD_VERSION "\", ") );
 #endif
-     "\"memory\":\"");
-    activeSerial->print(freeRam());
+    activeSerial->print( F("\"memory\":\"") );
+    activeSerial->print( MemoryMap::freeRam() );
+    activeSerial->print( F("\", \"stackMax\":\"") );
+    activeSerial->print( MemoryMap::stackHighWater() );
     activeSerial->println(F("\"}"));
+    printBootTiming( activeSerial );
+}
+
+
+void SerialCommand::printBootTiming(Stream* serial)
+{
+    serial->print( F("{\"event\":\"boot\", \"busReadyUs\":") );
+    serial->print( busReadyUs );
+    serial->print( F(", \"firstFrameUs\":") );
+    serial->print( firstFrameUs );
+    serial->println( F("}") );
 }
 
 
@@ -561,17 +821,61 @@ void SerialCommand::printChannelDebug(CANBus channel)
     }
     activeSerial->print( F("\", \"nextTxBuffer\":\""));
     activeSerial->print( channel.getNextTxBuffer(), DEC );
+    busScheduler.printStats( activeSerial, channel.busId - 1 );
+    busRx[channel.busId - 1].printStats( activeSerial );
     activeSerial->println(F("\"}"));
 }
 
 
+void SerialCommand::blockTransfer()
+{
+    byte cmd[6];
+    bool started = false;
+
+    if (getCommandBody( cmd, 1 ) == 1) {
+        byte bodyLength = (cmd[0] == 0x01)? 5 : 4;
+        if (getCommandBody( cmd + 1, bodyLength ) == bodyLength) {
+            unsigned int offset = (cmd[1] << 8) + cmd[2];
+            unsigned int length = (cmd[3] << 8) + cmd[4];
+            if (cmd[0] == 0x01) started = transfer.beginRead( activeSerial, offset, length, cmd[5] );
+            else if (cmd[0] == 0x02) started = transfer.beginWrite( activeSerial, offset, length );
+        }
+    }
+    // A write acks block 0 when ready, the host waits for it before sending
+    if (!started) activeSerial->write( COMMAND_ERROR );
+}
+
+
+/*
+*  Feed the transfer its port input and let it send what the link has room for
+*/
+void SerialCommand::transferTick()
+{
+    if (!transfer.active()) return;
+    Stream* serial = transfer.serial();
+
+    // Host closed the USB port
+    if (serial == &Serial && !Serial) {
+        transfer.cancel();
+        return;
+    }
+    while (transfer.active() && serial->available() > 0) transfer.feed( serial->read() );
+    if (!transfer.active()) return;
+
+    int room = serial->availableForWrite();
+    if (serial == &Serial1 && btTokens < room) room = btTokens;
+    int sent = transfer.tick( room );
+    if (serial == &Serial1) btTokens -= sent;
+}
+
+
 void SerialCommand::registerCommand(byte commandId, int dataLength, Middleware *cbInstance)
 {
     // About if we've reached the max number of registered callbacks
     if( mwCommandIndex >= MAX_MW_CALLBACKS ) return;
 
     mw_cmds[mwCommandIndex].command = commandId;
-    mw_cmds[mwCommandIndex].dataLength = dataLength;
+    mw_cmds[mwCommandIndex].dataLength = min(dataLength, MAX_MW_DATA_LENGTH);
     mw_cmds[mwCommandIndex].cbInstance = cbInstance;
     mwCommandIndex++;
 }
@@ -580,6 +884,7 @@ void SerialCommand::registerCommand(byte commandId, int dataLength, Middleware *
 void SerialCommand::resetToBootloader()
 {
     cli();
+    wdt_disable();
     UDCON = 1;
     USBCON = (1<<FRZCLK);  // disable USB
     UCSR1B = 0;
@@ -613,29 +918,12 @@ void SerialCommand::btDelay()
 {  
     byteCount++;  
     if( byteCount >= 8 ) {
+        LoopWatchdog::pet();
         delay(BT_SEND_DELAY);
         byteCount = 0;
     }
 }
 
 
-bool SerialCommand::btRateLimit()
-{
-    if ( millis() > lastBluetoothRX + 50 ) {
-        lastBluetoothRX = millis();
-        return false;
-    } else
-        return true;
-}
-
-
-int SerialCommand::freeRam ()
-{
-    extern int __heap_start, *__brkval;
-    int v;
-    return (int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval);
-}
-
-
 #endif
 
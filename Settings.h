@@ -3,6 +3,10 @@
 
 #include <avr/eeprom.h>
 #include <CANBus.h>
+#include "LedBlink.h"
+#include "LoopWatchdog.h"
+
+#define SETTINGS_CHUNK 32  // EEPROM bytes written between watchdog resets, 110 ms at most
 
 struct pid {
   byte busId;
@@ -26,14 +30,17 @@ struct cbt_settings {
   byte displayIndex;
   struct busConfig busCfg[3];  // 4bytes x 3 = 12bytes
   byte hwselftest;
-  byte placeholder4;
-  byte placeholder5;
-  byte placeholder6;
-  byte placeholder7;
+  byte readShare[3];  // Frames read per loop on each bus, 0 = default
+  byte sleepDelay;  // Idle seconds before powering down, 0 = default, 0xFF = never
   struct pid pids[8];  // 34bytes x 8 pids = 272bytes
-  byte padding[220];  // 512bytes - 292 bytes
+  byte rules[96];  // Rule programs, see RulesEngine.h
+  byte padding[120];  // 512bytes - 392 bytes
+  unsigned int transferOffset;  // Received range being saved, see BlockTransfer::recover()
+  unsigned int transferLength;  // 0 when none, kept last so it's saved after the rest
 } cbt_settings;
 
+byte settingsRevision;  // Changes when cbt_settings is replaced as a whole, see Settings::replaced()
+
 
 class Settings
 {
@@ -47,6 +54,10 @@ class Settings
    static int getBaudRate(byte busId);
    static void setCanMode(byte busId, int mode);
    static CANMode getCanMode(byte busId);
+   static void setReadShare(byte busId, byte share);
+   static byte getReadShare(byte busId);
+   static void setSleepDelay(byte seconds);
+   static void replaced() { settingsRevision++; }
 };
 
 
@@ -56,12 +67,19 @@ void Settings::init()
   eeprom_read_block((void*)&cbt_settings, (void*)0, sizeof(cbt_settings));
   if( cbt_settings.firstboot == 0 || cbt_settings.firstboot == 0xFF )
     Settings::firstbootSetup();
+  replaced();
 }
 
 
+// Only changed bytes are written, a full rewrite takes about 1.7 s
 void Settings::save( struct cbt_settings *settings )
 {
-  eeprom_write_block((const void*)settings, (void*)0, sizeof(cbt_settings));
+  const byte *data = (const byte*)settings;
+  for (unsigned int i = 0; i < sizeof(cbt_settings); i += SETTINGS_CHUNK) {
+    unsigned int n = sizeof(cbt_settings) - i;
+    eeprom_update_block(data + i, (void*)i, (n > SETTINGS_CHUNK)? SETTINGS_CHUNK : n);
+    LoopWatchdog::pet();
+  }
 }
 
 void Settings::setBaudRate(byte busId, int rate){
@@ -90,15 +108,36 @@ CANMode Settings::getCanMode(byte busId){
   return cbt_settings.busCfg[busId-1].mode;
 }
 
+void Settings::setReadShare(byte busId, byte share){
+  if( (busId < 1 || busId > 3)) return;
+
+  cbt_settings.readShare[busId-1] = share;
+  save(&cbt_settings);
+}
+
+byte Settings::getReadShare(byte busId){
+  if( (busId < 1 || busId > 3)) return 0;
+
+  return cbt_settings.readShare[busId-1];
+}
+
+void Settings::setSleepDelay(byte seconds){
+  cbt_settings.sleepDelay = seconds;
+  save(&cbt_settings);
+}
+
 
 void Settings::clear()
 {
-  for (int i = 0; i < 512; i++) EEPROM.write(i, 0);
+  for (int i = 0; i < 512; i++) {
+    eeprom_update_byte((uint8_t*)i, 0);
+    if ((i & (SETTINGS_CHUNK - 1)) == SETTINGS_CHUNK - 1) LoopWatchdog::pet();
+  }
 }
 
 void Settings::firstbootSetup()
 {
-  Settings::clear();
+  // Saving the stock settings overwrites all 512 bytes, members not listed are 0
 
   struct cbt_settings stockSettings = {
     1, // displayEnabled
@@ -110,10 +149,8 @@ void Settings::firstbootSetup()
       { 125, SLEEP }
     },
     0, // hwselftest
-    0, // placeholder4
-    0, // placeholder5
-    0, // placeholder6
-    0, // placeholder7
+    { 0, 0, 0 }, // readShare
+    0, // sleepDelay
     {
       {
         // EGT
@@ -206,6 +243,7 @@ void Settings::firstbootSetup()
         { 0x42, 0x41, 0x54, 0x54, 0x45, 0x52, 0x59, 0x20 }    /* NAM */
       }
     },
+    { 0 }, // rules, none
     // Padding for future changes
     { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } 
   };
@@ -215,12 +253,7 @@ void Settings::firstbootSetup()
   Serial.println( F("{\"event\":\"eepromReset\", \"result\":\"success\"}" ));
 
   // Slow flash to show first boot successful
-  for(int i=0;i<6;i++){
-    digitalWrite( BOOT_LED, HIGH );
-    delay(500);
-    digitalWrite( BOOT_LED, LOW );
-    delay(500);
-  }
+  bootBlink.start(6, 1000);
 }
 
 #endif // CBT_Settings_H
\ No newline at end of file
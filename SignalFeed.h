@@ -0,0 +1,211 @@
+#ifndef SignalFeed_H
+#define SignalFeed_H
+
+#include "Middleware.h"
+#include "Mazda3CAN.h"
+#include "SerialCommand.h"
+
+/*
+// Signal subscription commands, for the port they are sent on (USB and Bluetooth apart)
+----------------------------------------------------------------------------------------
+0xAA 0x01 N [SIG RATE THH THL] x N   Subscribe to N signals, replacing the current ones
+0xAA 0x02                            Unsubscribe from all signals
+0xAA 0x03                            Print subscriptions
+
+SIG is a Mazda3CAN::signal id, RATE the minimum time between updates in 10 ms units
+(0 = every change) and TH the change from the last value sent needed for an update
+(0 = any change). Updates of the signals that changed go out together as
+  0x14 N [SIG V3 V2 V1 V0] x N CHK
+with V the signed value in the units of the Mazda3CAN member, MSB first, and CHK the
+complement of the byte sum of the packet. Every subscribed signal is sent once right
+after subscribing. USB updates pause while slcan mode is on or the port is closed,
+Bluetooth ones while the link's byte budget (shared with 0x03 logging) is spent. Both
+pause during a settings block transfer.
+*/
+
+#define FEED_UPDATE 0x14
+#define FEED_PORTS 2           // USB, Bluetooth
+#define FEED_SUBSCRIPTIONS 6   // Per port
+#define FEED_RATE_MS 10
+
+struct feed_subscription {
+    byte signal;
+    byte rate;                 // FEED_RATE_MS units
+    unsigned int threshold;
+    long sent;                 // Last value sent
+    unsigned int sentMs;       // When, low 16 bits of millis()
+};
+
+class SignalFeed : public Middleware
+{
+public:
+    SignalFeed(Mazda3CAN *mazda_can, SerialCommand *serial_command);
+    void tick();
+    void commandHandler(byte* bytes, int length, Stream* activeSerial);
+
+private:
+    Mazda3CAN* _mazda;
+    SerialCommand* _serialCommand;
+    struct feed_subscription _subs[FEED_PORTS][FEED_SUBSCRIPTIONS];
+    byte _count[FEED_PORTS];
+    byte _due[FEED_PORTS];     // Subscriptions whose signal changed, one bit each
+    byte _fresh[FEED_PORTS];   // Subscriptions not sent yet
+
+    static Stream* port(byte p) { return (p == 0)? (Stream*)&Serial : (Stream*)&Serial1; }
+    bool writable(byte p);
+    void update(byte p);
+    bool subscribe(byte p, Stream* serial);
+    void printSubscriptions(byte p, Stream* serial);
+};
+
+
+SignalFeed::SignalFeed(Mazda3CAN *mazda_can, SerialCommand *serial_command)
+    : _mazda(mazda_can), _serialCommand(serial_command)
+{
+    for (byte p = 0; p < FEED_PORTS; p++) _count[p] = _due[p] = _fresh[p] = 0;
+}
+
+
+bool SignalFeed::writable(byte p)
+{
+    if (p == 0) return Serial && !_serialCommand->slcanActive() && !_serialCommand->transferActive(&Serial);
+    // Room for the largest packet, a due signal waits rather than blocking the loop
+    return _serialCommand->btRoom() >= 3 + _count[1] * 5;
+}
+
+
+void SignalFeed::tick()
+{
+    unsigned int changes = _mazda->takeChanges(LISTENER_FEED);
+    for (byte p = 0; p < FEED_PORTS; p++) {
+        if (_count[p] == 0) continue;
+        if (changes) {
+            for (byte s = 0; s < _count[p]; s++)
+                if (changes & Mazda3CAN::signalBit(_subs[p][s].signal)) _due[p] |= 1 << s;
+        }
+        if ((_due[p] || _fresh[p]) && writable(p)) update(p);
+    }
+}
+
+
+/*
+*  Send the due subscriptions that passed their rate and threshold in one packet.
+*  Those held back by the rate stay due, those under the threshold wait for a change.
+*/
+void SignalFeed::update(byte p)
+{
+    byte packet[3 + FEED_SUBSCRIPTIONS * 5];
+    byte n = 0, length = 2;
+    unsigned int now = millis();
+
+    for (byte s = 0; s < _count[p]; s++) {
+        byte bit = 1 << s;
+        if (!((_due[p] | _fresh[p]) & bit)) continue;
+        struct feed_subscription *sub = &_subs[p][s];
+        long value = _mazda->signal(sub->signal);
+
+        if (!(_fresh[p] & bit)) {
+            if ((unsigned int)(now - sub->sentMs) < sub->rate * FEED_RATE_MS) continue;
+            long change = value - sub->sent;
+            if (change < 0) change = -change;
+            if (change == 0 || (unsigned long)change < sub->threshold) {
+                _due[p] &= ~bit;
+                continue;
+            }
+        }
+        packet[length++] = sub->signal;
+        packet[length++] = value >> 24;
+        packet[length++] = value >> 16;
+        packet[length++] = value >> 8;
+        packet[length++] = value;
+        sub->sent = value;
+        sub->sentMs = now;
+        _due[p] &= ~bit;
+        _fresh[p] &= ~bit;
+        n++;
+    }
+    if (n == 0) return;
+
+    packet[0] = FEED_UPDATE;
+    packet[1] = n;
+    byte sum = 0;
+    for (byte i = 0; i < length; i++) sum += packet[i];
+    packet[length++] = ~sum;
+    port(p)->write(packet, length);
+    if (p == 1) _serialCommand->btSpend(length);
+}
+
+
+bool SignalFeed::subscribe(byte p, Stream* serial)
+{
+    byte n;
+    byte body[FEED_SUBSCRIPTIONS * 4];
+
+    if (readSerialBytes(serial, &n, 1) != 1 || n > FEED_SUBSCRIPTIONS) return false;
+    if (readSerialBytes(serial, body, n * 4) != n * 4) return false;
+    for (byte s = 0; s < n; s++)
+        if (body[s * 4] >= MAZDA_SIGNALS) return false;
+
+    for (byte s = 0; s < n; s++) {
+        struct feed_subscription *sub = &_subs[p][s];
+        sub->signal = body[s * 4];
+        sub->rate = body[s * 4 + 1];
+        sub->threshold = (body[s * 4 + 2] << 8) | body[s * 4 + 3];
+    }
+    _count[p] = n;
+    _due[p] = 0;
+    _fresh[p] = (1 << n) - 1;
+    return true;
+}
+
+
+void SignalFeed::printSubscriptions(byte p, Stream* serial)
+{
+    serial->print( F("{\"event\":\"subscriptions\", \"port\":") );
+    serial->print(p);
+    serial->print( F(", \"signals\":[") );
+    for (byte s = 0; s < _count[p]; s++) {
+        if (s > 0) serial->print( F(", ") );
+        serial->print( F("{\"signal\":") );
+        serial->print(_subs[p][s].signal);
+        serial->print( F(", \"rateMs\":") );
+        serial->print(_subs[p][s].rate * FEED_RATE_MS);
+        serial->print( F(", \"threshold\":") );
+        serial->print(_subs[p][s].threshold);
+        serial->print( F("}") );
+    }
+    serial->println( F("]}") );
+}
+
+
+void SignalFeed::commandHandler(byte* bytes, int length, Stream* activeSerial)
+{
+    byte p = (activeSerial == &Serial1)? 1 : 0;
+
+    if (length == 0) {
+        activeSerial->write(COMMAND_ERROR);
+        return;
+    }
+
+    switch (bytes[0]) {
+        case 0x01:
+            if (!subscribe(p, activeSerial)) {
+                activeSerial->write(COMMAND_ERROR);
+                return;
+            }
+            break;
+        case 0x02:
+            _count[p] = _due[p] = _fresh[p] = 0;
+            break;
+        case 0x03:
+            printSubscriptions(p, activeSerial);
+            return;
+        default:
+            activeSerial->write(COMMAND_ERROR);
+            return;
+    }
+    activeSerial->write(COMMAND_OK);
+    activeSerial->write(NEWLINE);
+}
+
+#endif // SignalFeed_H
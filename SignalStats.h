@@ -0,0 +1,277 @@
+#ifndef SignalStats_H
+#define SignalStats_H
+
+#include "Middleware.h"
+#include "Mazda3CAN.h"
+
+/*
+// Statistics commands
+----------------------
+0xA9 0x01          Print statistics
+0xA9 0x02          Restart statistics
+
+Min, max and mean of some Mazda3CAN signals over the last STATS_BUCKETS * STATS_BUCKET_MS
+and since the engine was started, in the units of the Mazda3CAN members.
+Min and max see every decoded value, means are sampled every STATS_SAMPLE_MS.
+The window is kept per bucket: a monotonic deque of bucket extremes for min and max and a
+ring of bucket means for the mean, so each update is O(1) and memory is fixed.
+*/
+
+#define STATS_BUCKETS 8        // Window length in buckets, a power of 2
+#define STATS_BUCKET_MS 4000
+#define STATS_SAMPLE_MS 100
+
+// Tracked signals
+#define STATS_RPM      0
+#define STATS_SPEED    1
+#define STATS_ENG_TEMP 2
+#define STATS_SIGNALS  3
+
+const byte statsSignalIds[STATS_SIGNALS] = { 0, 1, 3 };  // Mazda3CAN::signal ids
+
+
+/*
+*  Extremes of the last STATS_BUCKETS buckets. Values that can no longer be the
+*  extreme are dropped when pushed, so the front is always the answer.
+*/
+template <bool MAX>
+class MonotonicWindow
+{
+public:
+    void clear() { _head = _count = 0; }
+    bool isEmpty() { return _count == 0; }
+    int front() { return _value[_head]; }
+    void push(int value, byte bucket);
+
+private:
+    int _value[STATS_BUCKETS];
+    byte _bucket[STATS_BUCKETS];
+    byte _head;
+    byte _count;
+};
+
+
+template <bool MAX>
+void MonotonicWindow<MAX>::push(int value, byte bucket)
+{
+    // Out of the window once STATS_BUCKETS newer buckets exist
+    while (_count > 0 && (byte)(bucket - _bucket[_head]) >= STATS_BUCKETS) {
+        _head = (_head + 1) & (STATS_BUCKETS - 1);
+        _count--;
+    }
+    while (_count > 0) {
+        int back = _value[(_head + _count - 1) & (STATS_BUCKETS - 1)];
+        if (MAX? back > value : back < value) break;
+        _count--;
+    }
+    byte i = (_head + _count++) & (STATS_BUCKETS - 1);
+    _value[i] = value;
+    _bucket[i] = bucket;
+}
+
+
+class RollingStat
+{
+public:
+    void begin(int value);
+    void update(int value);
+    void sample(int value);
+    void close(byte bucket, int value);
+
+    int windowMin() { return (_min.isEmpty() || _bucketMin < _min.front())? _bucketMin : _min.front(); }
+    int windowMax() { return (_max.isEmpty() || _bucketMax > _max.front())? _bucketMax : _max.front(); }
+    int windowMean();
+    int sessionMin() { return (_bucketMin < _sessionMin)? _bucketMin : _sessionMin; }
+    int sessionMax() { return (_bucketMax > _sessionMax)? _bucketMax : _sessionMax; }
+    int sessionMean();
+
+private:
+    MonotonicWindow<false> _min;
+    MonotonicWindow<true> _max;
+    int _means[STATS_BUCKETS];  // Of the closed buckets, oldest overwritten
+    long _meanSum;
+    byte _meanCount;
+    int _bucketMin;
+    int _bucketMax;
+    long _bucketSum;
+    unsigned int _samples;      // In the open bucket
+    int _sessionMin;
+    int _sessionMax;
+    long _sessionSum;           // Of bucket means
+    unsigned int _sessionBuckets;
+};
+
+
+void RollingStat::begin(int value)
+{
+    _min.clear();
+    _max.clear();
+    _meanSum = _bucketSum = _sessionSum = 0;
+    _meanCount = 0;
+    _samples = _sessionBuckets = 0;
+    _bucketMin = _bucketMax = _sessionMin = _sessionMax = value;
+}
+
+
+void RollingStat::update(int value)
+{
+    if (value < _bucketMin) _bucketMin = value;
+    if (value > _bucketMax) _bucketMax = value;
+}
+
+
+void RollingStat::sample(int value)
+{
+    update(value);
+    _bucketSum += value;
+    _samples++;
+}
+
+
+// Ends bucket, the next one starts at value
+void RollingStat::close(byte bucket, int value)
+{
+    _min.push(_bucketMin, bucket);
+    _max.push(_bucketMax, bucket);
+    if (_bucketMin < _sessionMin) _sessionMin = _bucketMin;
+    if (_bucketMax > _sessionMax) _sessionMax = _bucketMax;
+
+    if (_samples > 0) {
+        int m = _bucketSum / _samples;
+        byte i = bucket & (STATS_BUCKETS - 1);
+        if (_meanCount == STATS_BUCKETS) _meanSum -= _means[i];
+        else _meanCount++;
+        _means[i] = m;
+        _meanSum += m;
+        _sessionSum += m;
+        _sessionBuckets++;
+    }
+    _bucketMin = _bucketMax = value;
+    _bucketSum = 0;
+    _samples = 0;
+}
+
+
+// The open bucket only counts until the first one is closed
+int RollingStat::windowMean()
+{
+    if (_meanCount > 0) return _meanSum / _meanCount;
+    return (_samples > 0)? _bucketSum / _samples : 0;
+}
+
+
+int RollingStat::sessionMean()
+{
+    if (_sessionBuckets > 0) return _sessionSum / _sessionBuckets;
+    return (_samples > 0)? _bucketSum / _samples : 0;
+}
+
+
+class SignalStats : public Middleware
+{
+public:
+    SignalStats(Mazda3CAN *mazda_can);
+    void tick();
+    void commandHandler(byte* bytes, int length, Stream* activeSerial);
+    void reset();
+    RollingStat& stat(byte s) { return _stats[s]; }
+
+private:
+    Mazda3CAN* _mazda;
+    RollingStat _stats[STATS_SIGNALS];
+    bool _collecting;
+    byte _bucket;
+    unsigned long _bucketStart;
+    unsigned long _lastSample;
+};
+
+
+SignalStats::SignalStats(Mazda3CAN *mazda_can) : _mazda(mazda_can), _collecting(false)
+{
+    reset();
+}
+
+
+void SignalStats::reset()
+{
+    for (byte s = 0; s < STATS_SIGNALS; s++) _stats[s].begin(_mazda->signal(statsSignalIds[s]));
+    _bucket = 0;
+    _bucketStart = _lastSample = millis();
+}
+
+
+void SignalStats::tick()
+{
+    unsigned int changes = _mazda->takeChanges(LISTENER_STATS);
+    if (_mazda->engineOn != _collecting) {
+        _collecting = _mazda->engineOn;
+        if (_collecting) reset();
+    }
+    if (!_collecting) return;
+
+    if (changes) {
+        for (byte s = 0; s < STATS_SIGNALS; s++)
+            if (changes & Mazda3CAN::signalBit(statsSignalIds[s]))
+                _stats[s].update(_mazda->signal(statsSignalIds[s]));
+    }
+
+    unsigned long now = millis();
+    if (now - _lastSample >= STATS_SAMPLE_MS) {
+        _lastSample += STATS_SAMPLE_MS;
+        for (byte s = 0; s < STATS_SIGNALS; s++) _stats[s].sample(_mazda->signal(statsSignalIds[s]));
+    }
+    if (now - _bucketStart >= STATS_BUCKET_MS) {
+        _bucketStart += STATS_BUCKET_MS;
+        for (byte s = 0; s < STATS_SIGNALS; s++) _stats[s].close(_bucket, _mazda->signal(statsSignalIds[s]));
+        _bucket++;
+    }
+}
+
+
+void SignalStats::commandHandler(byte* bytes, int length, Stream* activeSerial)
+{
+    if (length == 0) {
+        activeSerial->write(COMMAND_ERROR);
+        return;
+    }
+
+    switch (bytes[0]) {
+        case 0x01:
+            activeSerial->print( F("{\"event\":\"stats\", \"windowMs\":") );
+            activeSerial->print((unsigned long)STATS_BUCKETS * STATS_BUCKET_MS);
+            activeSerial->print( F(", \"collecting\":") );
+            activeSerial->print(_collecting);
+            activeSerial->print( F(", \"signals\":[") );
+            for (byte s = 0; s < STATS_SIGNALS; s++) {
+                RollingStat &st = _stats[s];
+                if (s > 0) activeSerial->print( F(", ") );
+                activeSerial->print( F("{\"signal\":") );
+                activeSerial->print(statsSignalIds[s]);
+                activeSerial->print( F(", \"min\":") );
+                activeSerial->print(st.windowMin());
+                activeSerial->print( F(", \"max\":") );
+                activeSerial->print(st.windowMax());
+                activeSerial->print( F(", \"mean\":") );
+                activeSerial->print(st.windowMean());
+                activeSerial->print( F(", \"sessionMin\":") );
+                activeSerial->print(st.sessionMin());
+                activeSerial->print( F(", \"sessionMax\":") );
+                activeSerial->print(st.sessionMax());
+                activeSerial->print( F(", \"sessionMean\":") );
+                activeSerial->print(st.sessionMean());
+                activeSerial->print( F("}") );
+            }
+            activeSerial->println( F("]}") );
+            return;
+        case 0x02:
+            reset();
+            break;
+        default:
+            activeSerial->write(COMMAND_ERROR);
+            return;
+    }
+    activeSerial->write(COMMAND_OK);
+    activeSerial->write(NEWLINE);
+}
+
+#endif // SignalStats_H
@@ -0,0 +1,314 @@
+#ifndef Slcan_H
+#define Slcan_H
+
+#include <avr/pgmspace.h>
+#include <CANBus.h>
+#include <MessageQueue.h>
+#include "MessageRing.h"
+#include "Settings.h"
+#include "BusScheduler.h"
+
+/*
+*  SLCAN (Lawicel) ASCII mode on one bus
+*
+*  Host commands, each ending with CR. Replies are CR for ok, BELL for error.
+*  O / L     Open the bus in normal / listen only mode, all frames are received
+*  C         Close the bus, restoring its masks, bitrate and mode
+*  S0-S8     Bitrate 10, 20, 50, 100, 125, 250, 500, 800, 1000 kbit/s, used by the next open
+*  tiiiLdd   Send a standard frame, replies z
+*  Z0 / Z1   Timestamps off / on, ms in 0-59999 appended to received frames
+*  V N F     Version, serial number, error flags
+*
+*  Received frames are sent as tiiiLdd..[tttt]. Extended frames (T) aren't supported,
+*  the queues only carry 11-bit ids.
+*  Output is gathered in a USB packet sized buffer, written when it is full, when a
+*  command is answered or once a loop went by without a frame.
+*  Bus 3 is read as a background bus (see BusScheduler.h): its frames only come in
+*  while busses 1 and 2 have nothing pending, so some are lost when those are busy.
+*/
+
+#define SLCAN_LINE_SIZE 28  // T + 8 id + len + 16 data + CR, the longest command
+#define SLCAN_OUT_SIZE 64   // USB full speed bulk packet
+#define SLCAN_OK '\r'
+#define SLCAN_ERROR 0x07
+#define SLCAN_EXIT 0x1B     // ESC leaves slcan mode
+#define RXM0SIDH 0x20       // RXM0SIDH..RXM0EID0, RXM1SIDH..RXM1EID0
+#define RXM_REGISTERS 8
+
+const char slcanHex[] PROGMEM = "0123456789ABCDEF";
+const int slcanBitrates[] PROGMEM = { 10, 20, 50, 100, 125, 250, 500, 800, 1000 };
+
+class Slcan
+{
+  public:
+    Slcan(MessageRing *writeQueue);
+    bool active() { return _bus != 0; }
+    void begin(byte busId, Stream* serial);
+    void end();
+    void feed(byte c);
+    void frame(const Message &msg);
+    void tick();
+
+  private:
+    Stream* _serial;
+    MessageRing* _writeQueue;
+    byte _bus;          // 1-3, 0 = slcan mode off
+    bool _open;
+    bool _listenOnly;
+    bool _timestamps;
+    bool _overflow;
+    byte _masks[RXM_REGISTERS];  // RX buffer masks before opening
+    int _bitrate;       // kbit/s for the next open, 0 = configured rate
+    char _line[SLCAN_LINE_SIZE];
+    byte _lineLength;
+    char _out[SLCAN_OUT_SIZE];
+    byte _outLength;
+    bool _framed;       // A frame was added since the last tick
+
+    void command();
+    bool transmit();
+    void openBus(CANMode mode);
+    void closeBus();
+    void reply(const char *text, byte length);
+    void reply(char c) { reply(&c, 1); }
+    void flush();
+    static char* hexByte(char *p, byte b);
+    static int parseHex(const char *p, byte digits);
+};
+
+
+Slcan::Slcan(MessageRing *writeQueue)
+    : _serial(0), _writeQueue(writeQueue), _bus(0), _open(false), _listenOnly(false),
+      _timestamps(false), _overflow(false), _bitrate(0), _lineLength(0), _outLength(0), _framed(false)
+{
+}
+
+
+void Slcan::begin(byte busId, Stream* serial)
+{
+    _serial = serial;
+    _bus = busId;
+    _open = _timestamps = _overflow = false;
+    _bitrate = 0;
+    _lineLength = 0;
+    _outLength = 0;
+}
+
+
+void Slcan::end()
+{
+    if (_open) closeBus();
+    flush();
+    _bus = 0;
+}
+
+
+void Slcan::feed(byte c)
+{
+    if (c == SLCAN_EXIT) {
+        end();
+        return;
+    }
+    if (c == '\r') {
+        if (_overflow) reply(SLCAN_ERROR);
+        else command();
+        flush();
+        _lineLength = 0;
+        _overflow = false;
+        return;
+    }
+    if (c == '\n') return;
+    if (_lineLength < SLCAN_LINE_SIZE) _line[_lineLength++] = c;
+    else _overflow = true;
+}
+
+
+void Slcan::command()
+{
+    char buf[6];
+    CANBus *bus = &busses[_bus - 1];
+
+    if (_lineLength == 0) {
+        reply(SLCAN_OK);
+        return;
+    }
+
+    switch (_line[0]) {
+        case 'O':
+        case 'L':
+            if (_open) break;
+            openBus(_line[0] == 'O'? NORMAL : LISTEN);
+            reply(SLCAN_OK);
+            return;
+        case 'C':
+            if (!_open) break;
+            closeBus();
+            reply(SLCAN_OK);
+            return;
+        case 'S':
+            if (_open || _lineLength != 2 || _line[1] < '0' || _line[1] > '8') break;
+            _bitrate = pgm_read_word(&slcanBitrates[_line[1] - '0']);
+            reply(SLCAN_OK);
+            return;
+        case 't':
+            if (!transmit()) break;
+            reply("z\r", 2);
+            return;
+        case 'Z':
+            if (_lineLength != 2 || (_line[1] != '0' && _line[1] != '1')) break;
+            _timestamps = (_line[1] == '1');
+            reply(SLCAN_OK);
+            return;
+        case 'V':
+            reply("V0106\r", 6);
+            return;
+        case 'N':
+            reply("NCB", 3);
+            buf[0] = '0' + _bus;
+            buf[1] = '\r';
+            reply(buf, 2);
+            return;
+        case 'F':
+            buf[0] = 'F';
+            hexByte(buf + 1, bus->readRegister(EFLG));
+            buf[3] = '\r';
+            reply(buf, 4);
+            return;
+    }
+    reply(SLCAN_ERROR);
+}
+
+
+bool Slcan::transmit()
+{
+    if (!_open || _listenOnly || _lineLength < 5) return false;
+    int id = parseHex(_line + 1, 3);
+    byte length = _line[4] - '0';
+    if (id < 0 || id > 0x7FF || length > 8 || _lineLength != 5 + length * 2) return false;
+
+    Frame *frame = _writeQueue->reserve();
+    if (frame == NULL) return false;
+    for (byte i = 0; i < length; i++) {
+        int b = parseHex(_line + 5 + i * 2, 2);
+        if (b < 0) return false; // Slot is handed out again by the next reserve
+        frame->data[i] = b;
+    }
+    for (byte i = length; i < 8; i++) frame->data[i] = 0;
+    frame->set(_bus, id, length, true);
+    _writeQueue->commit();
+    return true;
+}
+
+
+// Receive everything while open, the filters are left alone and only the masks cleared
+void Slcan::openBus(CANMode mode)
+{
+    CANBus *bus = &busses[_bus - 1];
+    bus->setMode(CONFIGURATION);
+    for (byte r = 0; r < RXM_REGISTERS; r++) {
+        _masks[r] = bus->readRegister(RXM0SIDH + r);
+        bus->writeRegister(RXM0SIDH + r, 0);
+    }
+    if (_bitrate != 0) bus->baudConfig(_bitrate);
+    bus->setMode(mode);
+    busScheduler.setMode(_bus - 1, mode);
+    _listenOnly = (mode == LISTEN);
+    _open = true;
+}
+
+
+void Slcan::closeBus()
+{
+    CANBus *bus = &busses[_bus - 1];
+    bus->setMode(CONFIGURATION);
+    for (byte r = 0; r < RXM_REGISTERS; r++) bus->writeRegister(RXM0SIDH + r, _masks[r]);
+    if (_bitrate != 0) bus->baudConfig(cbt_settings.busCfg[_bus - 1].baud);
+    bus->setMode(cbt_settings.busCfg[_bus - 1].mode);
+    busScheduler.setMode(_bus - 1, cbt_settings.busCfg[_bus - 1].mode);
+    _open = false;
+}
+
+
+/*
+*  Received frame as tiiiLdd..[tttt]CR, built in one buffer and added to the output
+*/
+void Slcan::frame(const Message &msg)
+{
+    if (!_open || msg.busId != _bus) return;
+
+    char line[SLCAN_LINE_SIZE];
+    char *p = line;
+    byte length = (msg.length > 8)? 8 : msg.length;
+
+    *p++ = 't';
+    *p++ = pgm_read_byte(&slcanHex[(msg.frame_id >> 8) & 0x07]);
+    p = hexByte(p, msg.frame_id);
+    *p++ = '0' + length;
+    for (byte i = 0; i < length; i++) p = hexByte(p, msg.frame_data[i]);
+    if (_timestamps) {
+        unsigned int t = millis() % 60000;
+        p = hexByte(p, t >> 8);
+        p = hexByte(p, t);
+    }
+    *p++ = '\r';
+    reply(line, p - line);
+    _framed = true;
+}
+
+
+// Called every loop, the output goes out once a loop added nothing to it
+void Slcan::tick()
+{
+    if (_framed) _framed = false;
+    else flush();
+}
+
+
+// Lines may straddle two writes so every full buffer is one USB packet
+void Slcan::reply(const char *text, byte length)
+{
+    while (length > 0) {
+        byte n = SLCAN_OUT_SIZE - _outLength;
+        if (n > length) n = length;
+        memcpy(_out + _outLength, text, n);
+        _outLength += n;
+        text += n;
+        length -= n;
+        if (_outLength == SLCAN_OUT_SIZE) flush();
+    }
+}
+
+
+void Slcan::flush()
+{
+    if (_outLength == 0) return;
+    _serial->write((const uint8_t*)_out, _outLength);
+    _outLength = 0;
+}
+
+
+char* Slcan::hexByte(char *p, byte b)
+{
+    *p++ = pgm_read_byte(&slcanHex[b >> 4]);
+    *p++ = pgm_read_byte(&slcanHex[b & 0x0F]);
+    return p;
+}
+
+
+// Value of digits hex characters, -1 if one isn't a hex digit
+int Slcan::parseHex(const char *p, byte digits)
+{
+    int v = 0;
+    for (byte i = 0; i < digits; i++) {
+        char c = p[i];
+        byte n;
+        if (c >= '0' && c <= '9') n = c - '0';
+        else if (c >= 'A' && c <= 'F') n = c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f') n = c - 'a' + 10;
+        else return -1;
+        v = (v << 4) | n;
+    }
+    return v;
+}
+
+#endif // Slcan_H
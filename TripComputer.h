@@ -0,0 +1,226 @@
+#ifndef TripComputer_H
+#define TripComputer_H
+
+#include <MessageQueue.h>
+#include "Middleware.h"
+#include "Mazda3CAN.h"
+
+/*
+// Trip computer commands
+-------------------------
+0xA6 0x01          Reset trip
+0xA6 0x02          Print trip values
+0xA6 0x03 UH UL    Set fuel counter calibration in microlitres per count
+
+All values are fixed point, scaled by 10 to keep one decimal digit. -1 means not available.
+The fuel counter of message 0x420 has no documented unit: calibrate it at a refill with
+microlitres per count = litres refilled * 1000000 / fuel counts since the previous refill.
+*/
+
+#define TRIP_FUEL_UL_PER_COUNT 25  // Placeholder calibration, see above
+#define TRIP_EMA_SHIFT 3           // Instant consumption smoothing, 1/8 per 0x420 frame
+#define TRIP_WINDOW 8              // Buckets of the moving window
+#define TRIP_BUCKET_MS 2000        // Window covers TRIP_WINDOW * TRIP_BUCKET_MS
+
+class TripComputer : public Middleware
+{
+public:
+    TripComputer(Mazda3CAN *mazda_can);
+    Message process(Message msg);
+    void commandHandler(byte* bytes, int length, Stream* activeSerial);
+    void reset();
+
+    long instantConsumption();  // L/100km * 10
+    long windowConsumption();   // L/100km * 10, over the moving window
+    long averageConsumption();  // L/100km * 10, since trip reset
+    long averageKmPerLitre();   // km/L * 10
+    long averageSpeed();        // km/h * 10, while moving
+    long fuelUsed();            // L * 10
+
+private:
+    Mazda3CAN* _mazda;
+    unsigned int _ulPerCount;
+    unsigned long _lastDist;
+    unsigned long _lastFuel;
+    unsigned long _tripDist;    // m * 5
+    unsigned long _tripFuel;    // Fuel counts
+    unsigned long _movingMs;
+    unsigned long _last201;
+    unsigned long _emaDist;     // Q8 per 0x420 frame
+    unsigned long _emaFuel;
+    unsigned int _winDist[TRIP_WINDOW];
+    unsigned int _winFuel[TRIP_WINDOW];
+    unsigned long _winDistSum;
+    unsigned long _winFuelSum;
+    byte _winBucket;
+    unsigned long _winBucketEnd;
+
+    void update420();
+    void advanceWindow(unsigned long now);
+    static long ratio(unsigned long a, unsigned long b, unsigned long mul);
+};
+
+TripComputer::TripComputer(Mazda3CAN *mazda_can)
+    : _ulPerCount(TRIP_FUEL_UL_PER_COUNT)
+{
+    _mazda = mazda_can;
+    reset();
+}
+
+void TripComputer::reset()
+{
+    _lastDist = _mazda->distance;
+    _lastFuel = _mazda->fuel;
+    _tripDist = _tripFuel = _movingMs = 0;
+    _emaDist = _emaFuel = 0;
+    memset(_winDist, 0, sizeof(_winDist));
+    memset(_winFuel, 0, sizeof(_winFuel));
+    _winDistSum = _winFuelSum = 0;
+    _winBucket = 0;
+    _last201 = _winBucketEnd = millis();
+}
+
+Message TripComputer::process(Message msg)
+{
+    // Runs after Mazda3CAN, so its counters already include this frame
+    if (msg.busId > MAZDA_LAST_BUS) return msg;
+    switch(msg.frame_id) {
+        case 0x201:
+        {
+            unsigned long now = millis();
+            if (_mazda->speed > 0) _movingMs += now - _last201;
+            _last201 = now;
+            break;
+        }
+        case 0x420:
+            update420();
+            break;
+    }
+    return msg;
+}
+
+void TripComputer::update420()
+{
+    unsigned long dDist = _mazda->distance - _lastDist;
+    unsigned long dFuel = _mazda->fuel - _lastFuel;
+    _lastDist = _mazda->distance;
+    _lastFuel = _mazda->fuel;
+
+    _tripDist += dDist;
+    _tripFuel += dFuel;
+
+    // Exponential moving average in Q8
+    _emaDist = _emaDist - (_emaDist >> TRIP_EMA_SHIFT) + ((dDist << 8) >> TRIP_EMA_SHIFT);
+    _emaFuel = _emaFuel - (_emaFuel >> TRIP_EMA_SHIFT) + ((dFuel << 8) >> TRIP_EMA_SHIFT);
+
+    advanceWindow(millis());
+    _winDist[_winBucket] += dDist;
+    _winFuel[_winBucket] += dFuel;
+    _winDistSum += dDist;
+    _winFuelSum += dFuel;
+}
+
+void TripComputer::advanceWindow(unsigned long now)
+{
+    for (byte n = 0; n < TRIP_WINDOW && (long)(now - _winBucketEnd) >= 0; n++) {
+        _winBucket = (_winBucket + 1) % TRIP_WINDOW;
+        _winDistSum -= _winDist[_winBucket];
+        _winFuelSum -= _winFuel[_winBucket];
+        _winDist[_winBucket] = _winFuel[_winBucket] = 0;
+        _winBucketEnd += TRIP_BUCKET_MS;
+    }
+    // Idle for longer than the whole window
+    if ((long)(now - _winBucketEnd) >= 0) _winBucketEnd = now + TRIP_BUCKET_MS;
+}
+
+// a * mul / b, scaling down operands instead of overflowing. -1 when b is 0
+long TripComputer::ratio(unsigned long a, unsigned long b, unsigned long mul)
+{
+    if (b == 0) return -1;
+    while (a > 0xFFFFFFFFUL / mul) {
+        a >>= 1;
+        b >>= 1;
+        if (b == 0) return -1;
+    }
+    return a * mul / b;
+}
+
+// L/100km * 10 = uL / m = uL * 5 / distance counts
+long TripComputer::instantConsumption()
+{
+    return ratio(_emaFuel * _ulPerCount, _emaDist, 5);
+}
+
+long TripComputer::windowConsumption()
+{
+    advanceWindow(millis());
+    return ratio(_winFuelSum * _ulPerCount, _winDistSum, 5);
+}
+
+long TripComputer::averageConsumption()
+{
+    return ratio(_tripFuel * _ulPerCount, _tripDist, 5);
+}
+
+// km/L * 10 = counts / 5000 * 10 / (uL / 1000000) = counts * 2000 / uL
+long TripComputer::averageKmPerLitre()
+{
+    return ratio(_tripDist, _tripFuel * _ulPerCount, 2000);
+}
+
+// km/h * 10 = counts / 5 / (ms / 1000) * 3.6 * 10 = counts * 7200 / ms
+long TripComputer::averageSpeed()
+{
+    return ratio(_tripDist, _movingMs, 7200);
+}
+
+long TripComputer::fuelUsed()
+{
+    return _tripFuel * _ulPerCount / 100000L;
+}
+
+void TripComputer::commandHandler(byte* bytes, int length, Stream* activeSerial)
+{
+    if (length == 0) {
+        activeSerial->write(COMMAND_ERROR);
+        return;
+    }
+
+    byte cmd[2];
+    switch(bytes[0]) {
+        case 0x01:
+            reset();
+            break;
+        case 0x02:
+            activeSerial->print( F("{\"event\":\"trip\", \"instant\":") );
+            activeSerial->print(instantConsumption());
+            activeSerial->print( F(", \"window\":") );
+            activeSerial->print(windowConsumption());
+            activeSerial->print( F(", \"average\":") );
+            activeSerial->print(averageConsumption());
+            activeSerial->print( F(", \"kmPerLitre\":") );
+            activeSerial->print(averageKmPerLitre());
+            activeSerial->print( F(", \"speed\":") );
+            activeSerial->print(averageSpeed());
+            activeSerial->print( F(", \"fuel\":") );
+            activeSerial->print(fuelUsed());
+            activeSerial->print( F(", \"distance\":") );
+            activeSerial->print(_tripDist);
+            activeSerial->println( F("}") );
+            return;
+        case 0x03:
+            if (readSerialBytes(activeSerial, cmd, 2) != 2 || (cmd[0] == 0 && cmd[1] == 0)) {
+                activeSerial->write(COMMAND_ERROR);
+                return;
+            }
+            _ulPerCount = (cmd[0] << 8) + cmd[1];
+            break;
+        default:
+            activeSerial->write(COMMAND_ERROR);
+            return;
+    }
+    activeSerial->write(COMMAND_OK);
+    activeSerial->write(NEWLINE);
+}
+
+#endif // TripComputer_H
@@ -0,0 +1,465 @@
+/*
+*  cbtlog - convert CANBus Triple binary logs
+*
+*  Reads the 0x03 log records written by SerialCommand (serial capture or stdin)
+*  and writes a candump log, a pcap file (LINKTYPE_CAN_SOCKETCAN) or a CSV of the
+*  signals decoded with the same rules as Mazda3CAN::process.
+*
+*  Build:  g++ -O2 -o cbtlog cbtlog.cpp
+*  Usage:  cbtlog [-f candump|pcap|csv] [-o output] [capture]
+*
+*  Record: 0x03 BUS IDH IDL D0-D7 LEN STATUS \r \n (16 bytes, STATUS bits 2-7 are 0
+*  since firmware 0.7, see SerialCommand.h), or the 0x12 key and
+*  0x13 delta records of LogEncoder.h. Bytes that don't form a valid record are skipped
+*  until the next one. Deltas are checked against the whole rebuilt payload: a delta
+*  that doesn't match, or comes before any key of its id, isn't output and its id waits
+*  for the next key. The counts are reported on stderr, a lossless stream has none.
+*  Records carry no time, candump and pcap timestamps are 0.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define RECORD_SIZE 16      // Longest record
+#define RECORD_PREFIX 0x03
+#define RECORD_KEY 0x12
+#define RECORD_DELTA 0x13
+#define IN_BUFFER_SIZE (1 << 20)
+#define OUT_BUFFER_SIZE (1 << 20)
+
+enum Format { CANDUMP, PCAP, CSV };
+
+struct Record {
+    uint8_t busId;
+    uint16_t id;
+    uint8_t data[8];
+    uint8_t length;
+    uint8_t status;
+};
+
+
+/*
+*  Buffered output, flushed with one fwrite() per OUT_BUFFER_SIZE bytes
+*/
+class Output
+{
+public:
+    Output(FILE *f) : _f(f), _used(0) {}
+    ~Output() { flush(); }
+
+    void put(char c) { reserve(1); _buf[_used++] = c; }
+    void put(const void *p, size_t n) { reserve(n); memcpy(_buf + _used, p, n); _used += n; }
+    void puts(const char *s) { put(s, strlen(s)); }
+    void hex(uint8_t b) { reserve(2); _buf[_used++] = HEX[b >> 4]; _buf[_used++] = HEX[b & 0x0F]; }
+    void nibble(uint8_t n) { put(HEX[n & 0x0F]); }
+    void number(long v);
+    void fixed(long v, int divisor, int decimals);
+    void flush() { if (_used) fwrite(_buf, 1, _used, _f); _used = 0; }
+
+private:
+    static const char HEX[];
+    FILE *_f;
+    char _buf[OUT_BUFFER_SIZE];
+    size_t _used;
+
+    void reserve(size_t n) { if (_used + n > OUT_BUFFER_SIZE) flush(); }
+};
+
+const char Output::HEX[] = "0123456789ABCDEF";
+
+void Output::number(long v)
+{
+    char tmp[24];
+    int n = 0;
+    bool negative = v < 0;
+    unsigned long u = negative? -(unsigned long)v : v;
+    do { tmp[n++] = '0' + u % 10; u /= 10; } while (u);
+    if (negative) tmp[n++] = '-';
+    reserve(n);
+    while (n) _buf[_used++] = tmp[--n];
+}
+
+// v / divisor with the given decimals, rounded towards zero
+void Output::fixed(long v, int divisor, int decimals)
+{
+    long scale = 1;
+    for (int i = 0; i < decimals; i++) scale *= 10;
+    long scaled = v * scale / divisor;
+    if (scaled < 0) { put('-'); scaled = -scaled; }
+    number(scaled / scale);
+    if (decimals == 0) return;
+    put('.');
+    char tmp[8];
+    long frac = scaled % scale;
+    for (int i = decimals - 1; i >= 0; i--) { tmp[i] = '0' + frac % 10; frac /= 10; }
+    put(tmp, decimals);
+}
+
+
+#define MAZDA_LAST_BUS 2  // As in Mazda3CAN.h, frames of bus 3 aren't decoded
+
+/*
+*  Mazda3CAN::process on the host
+*/
+class Mazda3Decoder
+{
+public:
+    int rpm;
+    int speed;           // 100 * Km/h
+    uint8_t gear;
+    uint8_t engTemp;
+    bool dashboardOn;
+    bool engineOn;
+    unsigned long distance; // m * 5
+    int mov;
+    unsigned long fuel;
+    uint8_t fuelLevel;   // l * 4
+    uint8_t intTemp;
+    int steering;
+
+    Mazda3Decoder() : rpm(0), speed(0), gear(0), engTemp(86), dashboardOn(false), engineOn(false),
+        distance(0), mov(0), fuel(0), fuelLevel(0), intTemp(86), steering(0),
+        _distance(0), _fuel(0), _engineDashboard(0) {}
+
+    bool process(const Record &r);
+
+private:
+    uint8_t _distance;
+    uint8_t _fuel;
+    uint8_t _engineDashboard;
+
+    void updateEngineDashboard(uint8_t status);
+    uint8_t decodeGear(const Record &r);
+};
+
+bool Mazda3Decoder::process(const Record &r)
+{
+    if (r.busId > MAZDA_LAST_BUS) return false;
+    const uint8_t *d = r.data;
+    switch (r.id) {
+        case 0x201:
+            if (d[0] & 0x80) rpm = speed = 0;
+            else {
+                rpm = ((d[0] << 8) + d[1]) & 0x7FFF;
+                speed = ((d[4] << 8) + d[5]) & 0x7FFF;
+            }
+            return true;
+        case 0x231:
+            gear = decodeGear(r);
+            return true;
+        case 0x420:
+            engTemp = d[0];
+            if (d[5] != _engineDashboard) updateEngineDashboard(d[5]);
+            if (engineOn && d[1] != _distance) {
+                int diff = d[1] + ((d[1] < _distance)? 256 : 0) - _distance;
+                distance += diff;
+                if (gear == 0xE) mov -= diff; else mov += diff;
+                _distance = d[1];
+            }
+            if (d[2] != _fuel) {
+                if (d[2] == 0 && _fuel < 245) _fuel = 0;
+                else {
+                    fuel += d[2] + ((d[2] < _fuel)? 256 : 0) - _fuel;
+                    _fuel = d[2];
+                }
+            }
+            return true;
+        case 0x430:
+            fuelLevel = d[0];
+            return true;
+        case 0x433:
+            intTemp = d[2];
+            return true;
+        case 0x4DA:
+            steering = (d[0] == 0xFF)? 0 : (d[0] << 8) + d[1] - 32768;
+            return true;
+    }
+    return false;
+}
+
+void Mazda3Decoder::updateEngineDashboard(uint8_t status)
+{
+    switch (status) {
+        case 0x10: dashboardOn = true; engineOn = false; break;
+        case 0x20: engineOn = dashboardOn = true; break;
+        case 0x30:
+        case 0x90: dashboardOn = true; engineOn = false; _distance = 0; break;
+        default:   engineOn = dashboardOn = false; break;
+    }
+    _engineDashboard = status;
+}
+
+uint8_t Mazda3Decoder::decodeGear(const Record &r)
+{
+    if (r.data[6] & 0x40) return 0xF;
+    switch (r.data[1]) {
+        case 0x6F: return (r.data[0] == 0xE1)? 0xE : 1;
+        case 0xCD: return 2;
+        case 0x87: return 3;
+        case 0x5C: return 4;
+        case 0x47: return 5;
+        default:   return 0xF;
+    }
+}
+
+
+/*
+*  Writers
+*/
+static void writeCandump(Output &out, const Record &r)
+{
+    static const char *iface[] = { "can0", "can1", "can2" };
+    out.puts("(0000000000.000000) ");
+    out.puts(iface[r.busId - 1]);
+    out.put(' ');
+    out.nibble(r.id >> 8);
+    out.hex(r.id & 0xFF);
+    out.put('#');
+    for (int i = 0; i < r.length; i++) out.hex(r.data[i]);
+    out.put('\n');
+}
+
+static void put32le(Output &out, uint32_t v)
+{
+    uint8_t b[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+    out.put(b, 4);
+}
+
+static void writePcapHeader(Output &out)
+{
+    put32le(out, 0xA1B2C3D4);       // Magic, microsecond timestamps
+    put32le(out, 2 | (4 << 16));    // Version 2.4
+    put32le(out, 0);                // Timezone
+    put32le(out, 0);                // Timestamp accuracy
+    put32le(out, 16);               // Snap length
+    put32le(out, 227);              // LINKTYPE_CAN_SOCKETCAN
+}
+
+static void writePcap(Output &out, const Record &r)
+{
+    put32le(out, 0);                // ts_sec
+    put32le(out, 0);                // ts_usec
+    put32le(out, 16);
+    put32le(out, 16);
+    // struct can_frame, can_id in network byte order
+    uint8_t frame[16] = { 0, 0, (uint8_t)(r.id >> 8), (uint8_t)r.id, r.length, 0, 0, 0 };
+    memcpy(frame + 8, r.data, 8);
+    out.put(frame, 16);
+}
+
+static void writeCsvHeader(Output &out)
+{
+    out.puts("record,bus,id,rpm,speed,gear,engTemp,dashboard,engine,distance,mov,fuel,fuelLevel,intTemp,steering\n");
+}
+
+// One row per frame Mazda3CAN decodes, in the units Mazda3CAN displays
+static void writeCsv(Output &out, Mazda3Decoder &m, const Record &r, unsigned long index)
+{
+    if (!m.process(r)) return;
+    out.number(index); out.put(',');
+    out.number(r.busId); out.put(',');
+    out.nibble(r.id >> 8); out.hex(r.id & 0xFF); out.put(',');
+    out.number(m.rpm); out.put(',');
+    out.fixed(m.speed, 100, 2); out.put(',');
+    out.nibble(m.gear); out.put(',');
+    out.fixed((long)(m.engTemp / 4) * 10 + 35, 10, 1); out.put(',');
+    out.puts(m.dashboardOn? "ON," : "OFF,");
+    out.puts(m.engineOn? "ON," : "OFF,");
+    out.fixed(m.distance, 5, 1); out.put(',');
+    out.fixed(m.mov, 5, 1); out.put(',');
+    out.number(m.fuel); out.put(',');
+    out.fixed(m.fuelLevel, 4, 2); out.put(',');
+    out.fixed((long)(m.intTemp / 4) * 10 + 35, 10, 1); out.put(',');
+    out.number(m.steering);
+    out.put('\n');
+}
+
+
+/*
+*  Record parser, resynchronizes on the prefix / terminator pattern and checksums
+*/
+enum Parsed { INVALID, MORE, RECORD };
+
+struct Reference {
+    bool valid;
+    uint8_t info;       // STATUS << 4 | LEN
+    uint8_t data[8];
+};
+
+static Reference refs[4][2048];
+
+struct Counts {
+    unsigned long keys;
+    unsigned long deltas;
+    unsigned long unresolved;
+};
+
+static Parsed parsePlain(const uint8_t *p, size_t avail, Record &r, size_t &used)
+{
+    if (avail < 16) return MORE;
+    if (p[14] != '\r' || p[15] != '\n') return INVALID;
+    if (p[1] < 1 || p[1] > 3 || p[2] > 0x07 || p[12] > 8) return INVALID;
+    r.busId = p[1];
+    r.id = (p[2] << 8) | p[3];
+    memcpy(r.data, p + 4, 8);
+    r.length = p[12];
+    r.status = p[13];
+    used = 16;
+    return RECORD;
+}
+
+// Key and delta records of LogEncoder.h
+static Parsed parseEncoded(const uint8_t *p, size_t avail, Record &r, size_t &used, Counts &counts)
+{
+    if (avail < 5) return MORE;
+    uint8_t bus = p[1] >> 6;
+    if (bus < 1 || (p[1] & 0x38)) return INVALID;
+    r.busId = bus;
+    r.id = ((p[1] & 0x07) << 8) | p[2];
+    Reference &ref = refs[bus][r.id];
+    uint8_t sum = p[0] + p[1] + p[2] + p[3];
+
+    if (p[0] == RECORD_KEY) {
+        uint8_t length = p[3] & 0x0F;
+        if (length > 8 || (p[3] & 0xC0)) return INVALID;
+        if (avail < 5u + length) return MORE;
+        for (int i = 0; i < length; i++) sum += p[4 + i];
+        if ((uint8_t)~sum != p[4 + length]) return INVALID;
+        ref.valid = true;
+        ref.info = p[3];
+        memset(ref.data, 0, 8);
+        memcpy(ref.data, p + 4, length);
+        used = 5 + length;
+        counts.keys++;
+    } else {
+        uint8_t mask = p[3];
+        size_t n = 0;
+        for (int i = 0; i < 8; i++) n += (mask >> i) & 1;
+        if (avail < 5 + n) return MORE;
+        uint8_t length = ref.info & 0x0F;
+        if (!ref.valid || (mask >> length)) {
+            // No key seen for the id yet, or a stray 0x13: skip it a byte at a time
+            counts.unresolved++;
+            return INVALID;
+        }
+        uint8_t data[8];
+        memcpy(data, ref.data, 8);
+        for (int i = 0, k = 4; i < 8; i++)
+            if (mask & (1 << i)) data[i] = p[k++];
+        for (int i = 0; i < length; i++) sum += data[i];
+        if ((uint8_t)~sum != p[4 + n]) {
+            // Corrupted, a stray 0x13 or a record of this id was lost. The reference
+            // stays, a lost record keeps failing until the next key.
+            counts.unresolved++;
+            return INVALID;
+        }
+        used = 5 + n;
+        memcpy(ref.data, data, 8);
+        counts.deltas++;
+    }
+    memcpy(r.data, ref.data, 8);
+    r.length = ref.info & 0x0F;
+    r.status = ref.info >> 4;
+    return RECORD;
+}
+
+static Parsed parseRecord(const uint8_t *p, size_t avail, Record &r, size_t &used, Counts &counts)
+{
+    switch (p[0]) {
+        case RECORD_PREFIX: return parsePlain(p, avail, r, used);
+        case RECORD_KEY:
+        case RECORD_DELTA:  return parseEncoded(p, avail, r, used, counts);
+    }
+    return INVALID;
+}
+
+static const uint8_t* nextPrefix(const uint8_t *p, const uint8_t *end)
+{
+    for (; p < end; p++)
+        if (*p == RECORD_PREFIX || *p == RECORD_KEY || *p == RECORD_DELTA) return p;
+    return end;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: cbtlog [-f candump|pcap|csv] [-o output] [capture]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    Format format = CANDUMP;
+    const char *inName = NULL, *outName = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            const char *f = argv[++i];
+            if (!strcmp(f, "candump")) format = CANDUMP;
+            else if (!strcmp(f, "pcap")) format = PCAP;
+            else if (!strcmp(f, "csv")) format = CSV;
+            else usage();
+        }
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc) outName = argv[++i];
+        else if (argv[i][0] == '-' && argv[i][1] != 0) usage();
+        else if (inName == NULL) inName = argv[i];
+        else usage();
+    }
+
+    FILE *in = (inName && strcmp(inName, "-"))? fopen(inName, "rb") : stdin;
+    FILE *outFile = outName? fopen(outName, "wb") : stdout;
+    if (in == NULL || outFile == NULL) {
+        perror(in == NULL? inName : outName);
+        return 1;
+    }
+
+    static Output out(outFile);
+    static uint8_t buf[IN_BUFFER_SIZE + RECORD_SIZE];
+    Mazda3Decoder mazda;
+    Counts counts = { 0, 0, 0 };
+    unsigned long records = 0, skipped = 0;
+    size_t kept = 0;
+
+    if (format == PCAP) writePcapHeader(out);
+    else if (format == CSV) writeCsvHeader(out);
+
+    for (;;) {
+        size_t n = fread(buf + kept, 1, IN_BUFFER_SIZE, in);
+        size_t end = kept + n;
+        size_t pos = 0;
+        Record r;
+
+        // Until the last read, stop while a whole record might not be in the buffer
+        while (pos < end && (n == 0 || pos + RECORD_SIZE <= end)) {
+            size_t used = 0;
+            Parsed parsed = parseRecord(buf + pos, end - pos, r, used, counts);
+            if (parsed == MORE) break;
+            if (parsed == INVALID) {
+                // Jump to the next prefix byte
+                size_t to = nextPrefix(buf + pos + 1, buf + end) - buf;
+                skipped += to - pos;
+                pos = to;
+                continue;
+            }
+            pos += used;
+            switch (format) {
+                case CANDUMP: writeCandump(out, r); break;
+                case PCAP:    writePcap(out, r); break;
+                case CSV:     writeCsv(out, mazda, r, records); break;
+            }
+            records++;
+        }
+
+        kept = end - pos;
+        memmove(buf, buf + pos, kept);
+        if (n == 0) break;
+    }
+    skipped += kept;
+    out.flush();
+
+    fprintf(stderr, "%lu records (%lu keys, %lu deltas), %lu deltas unresolved, %lu bytes skipped\n",
+            records, counts.keys, counts.deltas, counts.unresolved, skipped);
+    if (outFile != stdout) fclose(outFile);
+    return 0;
+}
@@ -0,0 +1,211 @@
+/*
+*  pipelinebench - cost of the middleware loop, virtual activeMw array against Pipeline
+*
+*  Compiles Pipeline.h of the firmware on the host with stand-ins for the default
+*  middleware set: SerialCommand and Mazda3CAN declare tick() and process(),
+*  TripComputer only process(), Mazda3Lcd and CBTButtons only tick(). The old loop
+*  walks an array of Middleware pointers and makes a virtual call per stage, hooks
+*  that a class doesn't declare included. Stage bodies are kept minimal so the
+*  timings show the dispatch, and LoopWatchdog::stage() only stores the stage.
+*
+*  The static data lines are counted from the AVR object layout (2 byte pointers,
+*  vtables in .data, a 2 byte malloc header per allocation). Timings and the sizes
+*  of the old*()/new*() functions (nm -S) are from the host CPU and only compare the two.
+*
+*  Build:  g++ -O2 -I../queuebench -o pipelinebench pipelinebench.cpp
+*  Usage:  pipelinebench [loops]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "MessageQueue.h"
+
+class Stream;
+
+// Stand-in for the firmware watchdog, stage() stores what the loop is running
+#define LoopWatchdog_H
+#define STAGE_TICK 1
+#define STAGE_PROCESS 2
+volatile byte loopStage;
+volatile byte loopStageIndex;
+
+class LoopWatchdog
+{
+  public:
+    static void stage(byte stage, byte index) { loopStage = stage; loopStageIndex = index; }
+};
+
+#include "../../Pipeline.h"
+
+#define OLD_VTABLE_ENTRIES 3  // tick, process, commandHandler
+#define NEW_VTABLE_ENTRIES 1  // commandHandler
+
+volatile unsigned long work;
+
+
+// Old layout: every hook virtual, empty defaults still called
+class VirtualMiddleware
+{
+public:
+    virtual void tick() {};
+    virtual Message process(Message msg) { return msg; };
+    virtual void commandHandler(byte* bytes, int length, Stream* activeSerial) {};
+};
+
+class OldSerialCommand : public VirtualMiddleware
+{
+public:
+    void tick() { work++; }
+    Message process(Message msg) { work += msg.frame_id; return msg; }
+};
+
+class OldMazda3CAN : public VirtualMiddleware
+{
+public:
+    void tick() { work++; }
+    Message process(Message msg) { work += msg.frame_data[0]; return msg; }
+};
+
+class OldTripComputer : public VirtualMiddleware
+{
+public:
+    Message process(Message msg) { work += msg.length; return msg; }
+};
+
+class OldMazda3Lcd : public VirtualMiddleware
+{
+public:
+    void tick() { work++; }
+};
+
+class OldCBTButtons : public VirtualMiddleware
+{
+public:
+    void tick() { work++; }
+};
+
+VirtualMiddleware *activeMw[5];
+int activeMwLength = 5;
+
+
+// Same stages for Pipeline
+class SerialCommand : public Middleware
+{
+public:
+    void tick() { work++; }
+    Message process(Message msg) { work += msg.frame_id; return msg; }
+};
+
+class Mazda3CAN : public Middleware
+{
+public:
+    void tick() { work++; }
+    Message process(Message msg) { work += msg.frame_data[0]; return msg; }
+};
+
+class TripComputer : public Middleware
+{
+public:
+    Message process(Message msg) { work += msg.length; return msg; }
+};
+
+class Mazda3Lcd : public Middleware
+{
+public:
+    void tick() { work++; }
+};
+
+class CBTButtons : public Middleware
+{
+public:
+    void tick() { work++; }
+};
+
+SerialCommand serialCommand;
+Mazda3CAN mazda3Can;
+TripComputer tripComputer;
+Mazda3Lcd mazda3Lcd;
+CBTButtons cbtButtons;
+
+typedef Pipeline<
+    MW_STAGE(serialCommand),
+    MW_STAGE(mazda3Can),
+    MW_STAGE(tripComputer),
+    MW_STAGE(mazda3Lcd),
+    MW_STAGE(cbtButtons)
+> MiddlewarePipeline;
+
+
+// Ticks and processing of a received frame, as loop() ran them before Pipeline
+__attribute__((noinline)) void oldTick()
+{
+    for (int i = 0; i <= activeMwLength - 1; i++) {
+        LoopWatchdog::stage(STAGE_TICK, i);
+        activeMw[i]->tick();
+    }
+}
+
+__attribute__((noinline)) void oldProcess(Message &msg)
+{
+    for (int i = 0; i < activeMwLength; i++) {
+        LoopWatchdog::stage(STAGE_PROCESS, i);
+        msg = activeMw[i]->process(msg);
+    }
+}
+
+// The same through Pipeline
+__attribute__((noinline)) void newTick() { MiddlewarePipeline::tick(); }
+__attribute__((noinline)) void newProcess(Message &msg) { MiddlewarePipeline::process(msg); }
+
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int main(int argc, char **argv)
+{
+    unsigned long loops = (argc > 1)? strtoul(argv[1], NULL, 0) : 50000000UL;
+
+    // Heap objects as the sketch created them, out of sight of the optimizer
+    activeMw[0] = new OldSerialCommand();
+    activeMw[1] = new OldMazda3CAN();
+    activeMw[2] = new OldTripComputer();
+    activeMw[3] = new OldMazda3Lcd();
+    activeMw[4] = new OldCBTButtons();
+
+    Message msg = Message();
+    msg.frame_id = 0x201;
+    msg.length = 8;
+
+    double t0 = seconds();
+    for (unsigned long n = 0; n < loops; n++) oldTick();
+    double t1 = seconds();
+    for (unsigned long n = 0; n < loops; n++) oldProcess(msg);
+    double t2 = seconds();
+    unsigned long oldWork = work;
+    work = 0;
+    for (unsigned long n = 0; n < loops; n++) newTick();
+    double t3 = seconds();
+    for (unsigned long n = 0; n < loops; n++) newProcess(msg);
+    double t4 = seconds();
+    if (work != oldWork) {
+        fprintf(stderr, "pipelinebench: pipeline ran different stages\n");
+        return 1;
+    }
+
+    int n = activeMwLength;
+    printf("stage calls      activeMw %d tick + %d process -> Pipeline 4 tick + 3 process\n", n, n);
+    printf("static data      activeMw array %d + length 2 + heap headers %d bytes -> 0\n", 2 * n, 2 * n);
+    printf("vtables (.data)  %d bytes -> %d bytes\n",
+           n * 2 * (2 + OLD_VTABLE_ENTRIES), n * 2 * (2 + NEW_VTABLE_ENTRIES));
+    printf("tick             activeMw %.2f ns -> Pipeline %.2f ns per loop\n",
+           (t1 - t0) / loops * 1e9, (t3 - t2) / loops * 1e9);
+    printf("process          activeMw %.2f ns -> Pipeline %.2f ns per frame\n",
+           (t2 - t1) / loops * 1e9, (t4 - t3) / loops * 1e9);
+    return 0;
+}
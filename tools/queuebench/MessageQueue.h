@@ -0,0 +1,23 @@
+/*
+*  Host stand-in for the CANBus library header: the Message struct and Arduino types
+*  the firmware queue headers need.
+*/
+
+#ifndef MessageQueue_h
+#define MessageQueue_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t byte;
+
+struct Message {
+  byte busStatus;
+  byte length;
+  unsigned short frame_id;
+  byte frame_data[8];
+  bool dispatch;
+  byte busId;
+};
+
+#endif
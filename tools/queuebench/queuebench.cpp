@@ -0,0 +1,205 @@
+/*
+*  queuebench - slot size and host throughput of the firmware frame queues
+*
+*  Compiles ReadQueue.h, MessageRing.h and Frame.h of the firmware on the host and
+*  compares them with the previous layout, rings of whole Message structs. Queue sizes
+*  are the firmware's own constants. It also times the receive path of ReadQueue both
+*  ways: copying a stack Message in with push() and out with pop(), and filling the
+*  slot in place with reserve()/commit() then unpacking it once with peek()/release().
+*  Throughput is measured on the host CPU, it only compares the variants and says
+*  nothing of AVR timings.
+*
+*  Build:  g++ -O2 -I. -o queuebench queuebench.cpp
+*  Usage:  queuebench [frames]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "MessageQueue.h"
+#include "../../MessageRing.h"
+#include "../../ReadQueue.h"
+
+#define RING_SIZE WRITE_BUFFER_SIZE
+#define OLD_READ_SLOTS 20     // Message slots of the queues before packing
+#define OLD_WRITE_SLOTS 10
+#define AVR_MESSAGE 14        // sizeof(Message) on AVR, the host may pad it
+#define AVR_FRAME 11
+
+// Previous write queue layout, for comparison
+class WholeRing
+{
+public:
+    WholeRing(byte size, Message *buffer) : _buffer(buffer), _size(size), _head(0), _tail(0) {}
+    Message* reserve() { return (next(_head) == _tail)? NULL : &_buffer[_head]; }
+    void commit() { QUEUE_BARRIER(); _head = next(_head); }
+    Message* peek() { return (_head == _tail)? NULL : &_buffer[_tail]; }
+    void release() { QUEUE_BARRIER(); _tail = next(_tail); }
+
+private:
+    Message* _buffer;
+    byte _size;
+    volatile byte _head;
+    volatile byte _tail;
+
+    byte next(byte i) { return (i + 1 == _size)? 0 : i + 1; }
+};
+
+
+static double seconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+// Fill in place like the receive path, consume like loop(): a Message for the middleware
+static unsigned long runPacked(unsigned long frames)
+{
+    Frame buffer[RING_SIZE];
+    MessageRing ring(RING_SIZE, buffer);
+    unsigned long check = 0;
+    Message msg;
+
+    for (unsigned long n = 0; n < frames; n++) {
+        Frame *f = ring.reserve();
+        f->set(1 + (n & 1), n & 0x7FF, 8, n & 2, 1);
+        memset(f->data, (byte)n, 8);
+        ring.commit();
+
+        ring.peek()->unpack(msg);
+        ring.release();
+        check += msg.frame_id + msg.frame_data[7] + msg.busId;
+    }
+    return check;
+}
+
+
+static unsigned long runWhole(unsigned long frames)
+{
+    Message buffer[RING_SIZE];
+    WholeRing ring(RING_SIZE, buffer);
+    unsigned long check = 0;
+    Message msg;
+
+    for (unsigned long n = 0; n < frames; n++) {
+        Message *m = ring.reserve();
+        m->busStatus = 1;
+        m->busId = 1 + (n & 1);
+        m->dispatch = n & 2;
+        m->frame_id = n & 0x7FF;
+        m->length = 8;
+        memset(m->frame_data, (byte)n, 8);
+        ring.commit();
+
+        msg = *ring.peek();
+        ring.release();
+        check += msg.frame_id + msg.frame_data[7] + msg.busId;
+    }
+    return check;
+}
+
+
+// Stand-in for the MCP2515 read, the id and data bytes coming off SPI
+static inline byte spiByte(unsigned long n, byte i) { return (byte)(n * 7 + i); }
+
+
+// Receive path before reserve/commit: read into a stack Message, push() copies it in,
+// pop() copies it out for the pipeline
+static unsigned long runReadCopy(unsigned long frames)
+{
+    static ReadQueue queue;
+    unsigned long check = 0;
+
+    for (unsigned long n = 0; n < frames; n += 4) {
+        for (byte k = 0; k < 4; k++) {
+            Message read;
+            read.busStatus = 1;
+            read.busId = 1 + (k & 1);
+            read.dispatch = false;
+            read.frame_id = (n + k) & 0x7FF;
+            read.length = 8;
+            for (byte i = 0; i < 8; i++) read.frame_data[i] = spiByte(n + k, i);
+            queue.push(read, k & 1);
+        }
+        while (!queue.isEmpty()) {
+            Message msg = queue.pop();
+            check += msg.frame_id + msg.frame_data[7] + msg.busId;
+        }
+    }
+    return check;
+}
+
+
+// Receive path now: read straight into the reserved slot, unpack once for the pipeline
+static unsigned long runReadInPlace(unsigned long frames)
+{
+    static ReadQueue queue;
+    unsigned long check = 0;
+    Message msg;
+
+    for (unsigned long n = 0; n < frames; n += 4) {
+        for (byte k = 0; k < 4; k++) {
+            Frame *f = queue.reserve(k & 1);
+            f->set(1 + (k & 1), (n + k) & 0x7FF, 8, false, 1);
+            for (byte i = 0; i < 8; i++) f->data[i] = spiByte(n + k, i);
+            queue.commit(k & 1);
+        }
+        Frame *f;
+        while ((f = queue.peek()) != NULL) {
+            f->unpack(msg);
+            queue.release();
+            check += msg.frame_id + msg.frame_data[7] + msg.busId;
+        }
+    }
+    return check;
+}
+
+
+int main(int argc, char **argv)
+{
+    unsigned long frames = (argc > 1)? strtoul(argv[1], NULL, 10) : 50000000UL;
+
+    // Lane indexes: two bytes each, the AVR size of FrameLane
+    unsigned readBytes = READ_BUFFER_SIZE * AVR_FRAME + 2 * 2;
+    printf("bytes per slot   Message %u, Frame %u (AVR), Frame %u (host)\n", AVR_MESSAGE, AVR_FRAME, (unsigned)sizeof(Frame));
+    printf("read queue       %u slots in %u bytes -> %u slots (%u high, %u low) in %u bytes\n",
+           OLD_READ_SLOTS, OLD_READ_SLOTS * AVR_MESSAGE, READ_BUFFER_SIZE, READ_HIGH_SIZE, READ_LOW_SIZE, readBytes);
+    printf("write queue      %u slots in %u bytes -> %u slots in %u bytes\n",
+           OLD_WRITE_SLOTS, OLD_WRITE_SLOTS * AVR_MESSAGE, WRITE_BUFFER_SIZE, WRITE_BUFFER_SIZE * AVR_FRAME);
+    if (sizeof(Frame) != AVR_FRAME || readBytes > OLD_READ_SLOTS * AVR_MESSAGE ||
+        WRITE_BUFFER_SIZE * AVR_FRAME > OLD_WRITE_SLOTS * AVR_MESSAGE) {
+        fprintf(stderr, "queuebench: the queues outgrew the SRAM of the old ones\n");
+        return 1;
+    }
+
+    double t0 = seconds();
+    unsigned long a = runWhole(frames);
+    double t1 = seconds();
+    unsigned long b = runPacked(frames);
+    double t2 = seconds();
+    if (a != b) {
+        fprintf(stderr, "queuebench: packed frames differ from whole ones\n");
+        return 1;
+    }
+    printf("Message ring     %.1f Mframes/s\n", frames / (t1 - t0) / 1e6);
+    printf("Frame ring       %.1f Mframes/s (with unpack)\n", frames / (t2 - t1) / 1e6);
+
+    frames &= ~3UL;
+    t0 = seconds();
+    a = runReadCopy(frames);
+    t1 = seconds();
+    b = runReadInPlace(frames);
+    t2 = seconds();
+    if (a != b) {
+        fprintf(stderr, "queuebench: in place frames differ from copied ones\n");
+        return 1;
+    }
+    printf("read, copy       %.1f Mframes/s, %u bytes copied per frame (stack Message, push, pop)\n",
+           frames / (t1 - t0) / 1e6, 3 * AVR_MESSAGE);
+    printf("read, in place   %.1f Mframes/s, %u bytes copied per frame (unpack)\n",
+           frames / (t2 - t1) / 1e6, AVR_MESSAGE);
+    return 0;
+}
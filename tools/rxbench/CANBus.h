@@ -0,0 +1,31 @@
+/*
+*  Host stand-in for the CANBus library header: the pins, registers and Arduino
+*  bits Mcp2515Rx.h needs. Chip select of every bus is the cs byte of the fake
+*  MCP2515 in SPI.h.
+*/
+
+#ifndef CANBus_h
+#define CANBus_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <SPI.h>
+
+#define CAN1SELECT 9
+#define CAN2SELECT 10
+#define CAN3SELECT 5
+#define CANINTF 0x2C
+
+#define F(s) (s)
+#define digitalPinToPort(pin) (pin)
+#define digitalPinToBitMask(pin) ((uint8_t)0x01)
+#define portOutputRegister(port) (&SPI.cs)
+
+class Stream
+{
+  public:
+    void print(const char *s) { fputs(s, stdout); }
+    void print(unsigned long n) { printf("%lu", n); }
+};
+
+#endif
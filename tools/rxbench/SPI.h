@@ -0,0 +1,122 @@
+/*
+*  Host stand-in for the SPI library with one MCP2515 on the other end
+*
+*  Models the RX side of the controller: both RX buffers, CANINTF, RXB1CTRL and the
+*  READ, BIT MODIFY, READ STATUS, RX STATUS and READ RX BUFFER instructions. READ RX
+*  BUFFER clears its RXnIF flag when chip select goes high, as the datasheet says.
+*  The driver under test counts its chip selects in *selects, a change marks the
+*  start of a new transaction, which is also when the previous one ends.
+*/
+
+#ifndef SPI_h
+#define SPI_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPI_CLOCK_DIV2 4
+
+#define MCP_RXB0SIDH 0x61
+#define MCP_RXB1SIDH 0x71
+#define MCP_REG_RXB1CTRL 0x70
+#define MCP_REG_CANINTF 0x2C
+
+class SPIClass
+{
+  public:
+    volatile uint8_t cs;              // Chip select port, bit 0 low while selected
+    unsigned long *selects;
+    unsigned long transactions;
+    unsigned long bytes;
+
+    SPIClass() : cs(1), selects(0), transactions(0), bytes(0), _seen(0), _active(false), _lastFilter(0)
+    {
+        memset(_regs, 0, sizeof(_regs));
+    }
+
+    void setClockDivider(uint8_t) {}
+
+    // A frame arrives in RX buffer bufferId, matching filter
+    void receive(uint8_t bufferId, unsigned short id, uint8_t dlc, const uint8_t *data, uint8_t filter)
+    {
+        uint8_t *buf = &_regs[bufferId? MCP_RXB1SIDH : MCP_RXB0SIDH];
+        buf[0] = id >> 3;
+        buf[1] = (id & 0x07) << 5;
+        buf[2] = buf[3] = 0;
+        buf[4] = dlc;
+        memcpy(&buf[5], data, dlc);
+        memset(&buf[5 + dlc], 0xEE, 8 - dlc);   // Stale bytes, never to be seen
+        if (bufferId) _regs[MCP_REG_RXB1CTRL] = (_regs[MCP_REG_RXB1CTRL] & ~0x07) | filter;
+        _regs[MCP_REG_CANINTF] |= 1 << bufferId;
+        _lastFilter = filter;
+    }
+
+    uint8_t flags() const { return _regs[MCP_REG_CANINTF] & 0x03; }
+
+    uint8_t transfer(uint8_t out)
+    {
+        if (cs & 0x01) {
+            fprintf(stderr, "rxbench: SPI transfer without chip select\n");
+            exit(1);
+        }
+        if (*selects != _seen) {
+            finish();
+            _seen = *selects;
+            _active = true;
+            _cmd = out;
+            _pos = 0;
+            transactions++;
+            bytes++;
+            return 0;
+        }
+        bytes++;
+        return step(out);
+    }
+
+    // Chip select went high after the last transaction
+    void finish()
+    {
+        if (!_active) return;
+        _active = false;
+        if ((_cmd & 0xF9) == 0x90) _regs[MCP_REG_CANINTF] &= ~(1 << ((_cmd >> 2) & 0x01));
+    }
+
+  private:
+    uint8_t _regs[128];
+    unsigned long _seen;
+    bool _active;
+    uint8_t _cmd;
+    uint8_t _pos;
+    uint8_t _addr;
+    uint8_t _mask;
+    uint8_t _lastFilter;
+
+    uint8_t step(uint8_t out)
+    {
+        uint8_t pos = _pos++;
+        if (_cmd == 0xA0) return flags();                                        // READ STATUS
+        if (_cmd == 0xB0) return (flags() << 6) | _lastFilter;                   // RX STATUS
+        if ((_cmd & 0xF9) == 0x90) {                                             // READ RX BUFFER
+            if (pos == 0) _addr = (_cmd & 0x04)? MCP_RXB1SIDH : MCP_RXB0SIDH;
+            return _regs[_addr++ & 0x7F];
+        }
+        if (_cmd == 0x03) {                                                      // READ
+            if (pos == 0) { _addr = out; return 0; }
+            return _regs[_addr++ & 0x7F];
+        }
+        if (_cmd == 0x05) {                                                      // BIT MODIFY
+            if (pos == 0) _addr = out;
+            else if (pos == 1) _mask = out;
+            else if (pos == 2) _regs[_addr & 0x7F] = (_regs[_addr & 0x7F] & ~_mask) | (out & _mask);
+            return 0;
+        }
+        fprintf(stderr, "rxbench: unknown instruction 0x%02X\n", _cmd);
+        exit(1);
+    }
+};
+
+SPIClass SPI;
+
+#endif
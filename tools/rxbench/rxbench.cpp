@@ -0,0 +1,222 @@
+/*
+*  rxbench - SPI cost per received frame, CANBus library reads against Mcp2515Rx
+*
+*  Compiles Mcp2515Rx.h of the firmware on the host against a fake MCP2515 (SPI.h)
+*  and feeds both receive paths the same traffic: frames with 0 to 8 data bytes, half
+*  of them in RXB0 with rollover into RXB1 when it is full, the other half in RXB1.
+*  The library path is the sequence the sketch used before Mcp2515Rx: READ STATUS,
+*  then readFullFrame() per full buffer, which READs the id, DLC and all 8 data bytes
+*  and clears RXnIF with a BIT MODIFY. Both drain loops follow readBus() of their time.
+*
+*  The fake counts transactions and bytes on its side of the bus, every frame read is
+*  checked against what was received and the firmware's own counters against the fake.
+*
+*  Build:  g++ -O2 -I. -I../queuebench -o rxbench rxbench.cpp
+*  Usage:  rxbench [frames]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "MessageQueue.h"
+#include "SPI.h"
+#include "CANBus.h"
+#include "../../Mcp2515Rx.h"
+
+#define RX_STATUS_RXB0 0x40
+#define RX_STATUS_RXB1 0x80
+
+struct Sent {
+    unsigned short id;
+    byte dlc;
+    byte data[8];
+    bool read;
+};
+
+struct Cost {
+    unsigned long transactions;
+    unsigned long bytes;
+};
+
+
+// The CANBus library calls the sketch made per frame
+class LibraryRx
+{
+  public:
+    unsigned long selects;
+
+    LibraryRx() : selects(0) {}
+
+    byte readStatus()
+    {
+        select();
+        SPI.transfer(0xA0);
+        byte status = SPI.transfer(0);
+        deselect();
+        return status;
+    }
+
+    void readFullFrame(byte bufferId, byte *length, byte *data, unsigned short *id)
+    {
+        select();
+        SPI.transfer(0x03);
+        SPI.transfer(bufferId? 0x71 : 0x61);
+        byte sidh = SPI.transfer(0);
+        byte sidl = SPI.transfer(0);
+        SPI.transfer(0);
+        SPI.transfer(0);
+        *length = SPI.transfer(0) & 0x0F;
+        for (byte i = 0; i < 8; i++) data[i] = SPI.transfer(0);
+        deselect();
+        *id = ((unsigned short)sidh << 3) | (sidl >> 5);
+
+        select();
+        SPI.transfer(0x05);
+        SPI.transfer(CANINTF);
+        SPI.transfer(1 << bufferId);
+        SPI.transfer(0);
+        deselect();
+    }
+
+  private:
+    void select() { SPI.cs &= ~0x01; selects++; }
+    void deselect() { SPI.cs |= 0x01; }
+};
+
+
+static Sent *sent;
+static unsigned long nextRead;
+
+// A burst can be read out of arrival order, RXB0 goes first
+static void check(unsigned short id, byte dlc, const byte *data)
+{
+    for (unsigned long n = nextRead; n < nextRead + 2; n++) {
+        Sent &s = sent[n];
+        if (s.read || id != s.id || dlc != s.dlc || memcmp(data, s.data, dlc) != 0) continue;
+        s.read = true;
+        while (sent[nextRead].read) nextRead++;
+        return;
+    }
+    fprintf(stderr, "rxbench: frame %lu read back wrong\n", nextRead);
+    exit(1);
+}
+
+static void reset(unsigned long frames)
+{
+    for (unsigned long n = 0; n < frames; n++) sent[n].read = false;
+    nextRead = 0;
+}
+
+// Up to two frames arrive between reads, the second one while RXB0 may still be full
+static void arrive(unsigned long &n, unsigned long frames)
+{
+    byte count = (n % 3 == 0)? 2 : 1;
+    for (byte k = 0; k < count && n < frames; k++, n++) {
+        const Sent &s = sent[n];
+        bool rxb0 = (s.id & 1) == 0;
+        if (rxb0 && !(SPI.flags() & 0x01)) SPI.receive(0, s.id, s.dlc, s.data, 0);
+        else if (!(SPI.flags() & 0x02)) SPI.receive(1, s.id, s.dlc, s.data, rxb0? 0 : 2);
+        else {
+            fprintf(stderr, "rxbench: traffic overflowed the RX buffers\n");
+            exit(1);
+        }
+    }
+}
+
+
+static Cost runLibrary(unsigned long frames)
+{
+    LibraryRx lib;
+    SPI.selects = &lib.selects;
+    unsigned long t0 = SPI.transactions, b0 = SPI.bytes;
+    reset(frames);
+
+    for (unsigned long n = 0; n < frames; ) {
+        arrive(n, frames);
+        byte rx_status = 0x3;
+        while (rx_status & 0x3) {
+            rx_status = lib.readStatus();
+            Message msg;
+            if (rx_status & 0x1) {
+                lib.readFullFrame(0, &msg.length, msg.frame_data, &msg.frame_id);
+                check(msg.frame_id, msg.length, msg.frame_data);
+            }
+            if (rx_status & 0x2) {
+                lib.readFullFrame(1, &msg.length, msg.frame_data, &msg.frame_id);
+                check(msg.frame_id, msg.length, msg.frame_data);
+            }
+        }
+    }
+    SPI.finish();
+    Cost cost = { SPI.transactions - t0, SPI.bytes - b0 };
+    return cost;
+}
+
+
+static Cost runFastPath(unsigned long frames, unsigned long &rollovers)
+{
+    Mcp2515Rx rx(CAN1SELECT);
+    SPI.selects = &rx.transactions;
+    unsigned long t0 = SPI.transactions, b0 = SPI.bytes;
+    reset(frames);
+    rollovers = 0;
+
+    for (unsigned long n = 0; n < frames; ) {
+        arrive(n, frames);
+        while (true) {
+            byte rx_status = rx.rxStatus();
+            Frame frame;
+            frame.info = 0;
+            frame.idHigh = 0;
+            if (rx_status & RX_STATUS_RXB0) rx.readFrame(0, &frame);
+            else if (rx_status & RX_STATUS_RXB1) {
+                if (rx.rolledOver()) rollovers++;
+                rx.readFrame(1, &frame);
+            }
+            else break;
+            check(frame.id(), frame.length(), frame.data);
+        }
+    }
+    SPI.finish();
+    Cost cost = { SPI.transactions - t0, SPI.bytes - b0 };
+    if (cost.transactions != rx.transactions || cost.bytes != rx.bytes || rx.frames != frames) {
+        fprintf(stderr, "rxbench: Mcp2515Rx counted %lu transactions %lu bytes %lu frames, the fake %lu %lu %lu\n",
+                rx.transactions, rx.bytes, rx.frames, cost.transactions, cost.bytes, frames);
+        exit(1);
+    }
+    return cost;
+}
+
+
+int main(int argc, char **argv)
+{
+    unsigned long frames = (argc > 1)? strtoul(argv[1], NULL, 0) : 100000UL;
+
+    sent = new Sent[frames + 2];
+    memset(sent, 0, (frames + 2) * sizeof(Sent));
+    unsigned long payload = 0;
+    srand(1);
+    for (unsigned long n = 0; n < frames; n++) {
+        sent[n].id = rand() & 0x7FF;
+        if (n % 3 == 1 && (sent[n - 1].id & 1)) sent[n].id &= ~1;  // Pairs never both need RXB1
+        sent[n].dlc = rand() % 9;
+        for (byte i = 0; i < 8; i++) sent[n].data[i] = rand();
+        payload += sent[n].dlc;
+    }
+
+    unsigned long rollovers;
+    Cost lib = runLibrary(frames);
+    Cost fast = runFastPath(frames, rollovers);
+    if (nextRead != frames) {
+        fprintf(stderr, "rxbench: %lu of %lu frames read\n", nextRead, frames);
+        return 1;
+    }
+
+    printf("frames           %lu, %.2f data bytes each, %lu read from RXB1 after rollover\n",
+           frames, (double)payload / frames, rollovers);
+    printf("CANBus library   %.2f transactions, %.2f bytes per frame\n",
+           (double)lib.transactions / frames, (double)lib.bytes / frames);
+    printf("Mcp2515Rx        %.2f transactions, %.2f bytes per frame\n",
+           (double)fast.transactions / frames, (double)fast.bytes / frames);
+    return 0;
+}